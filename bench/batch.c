@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "myMalloc.h"
+
+/*
+ * Compares allocating and freeing many same-sized blocks one call at a time,
+ * the way mallocing_loop and freeing_loop in testing.c do, against a single
+ * my_malloc_batch and my_free_batch call.
+ *
+ * Every round allocates BATCH blocks, clears them, and frees them in a
+ * shuffled order so the freed blocks are not simply returned in reverse.
+ * Other blocks of the same size are kept alive between rounds so the heap is
+ * not one empty chunk.
+ */
+
+#define BATCH 256
+#define ROUNDS 4000
+
+static void * blocks[BATCH];
+static size_t order[BATCH];
+static void * kept[BATCH];
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void shuffle_order() {
+  for (size_t i = 0; i < BATCH; i++) {
+    order[i] = i;
+  }
+  for (size_t i = BATCH - 1; i > 0; i--) {
+    size_t j = rand() % (i + 1);
+    size_t t = order[i];
+    order[i] = order[j];
+    order[j] = t;
+  }
+}
+
+static double run_loop(size_t size) {
+  double start = now_ns();
+  for (int r = 0; r < ROUNDS; r++) {
+    for (size_t i = 0; i < BATCH; i++) {
+      blocks[i] = my_malloc(size);
+      memset(blocks[i], 0, size);
+    }
+    for (size_t i = 0; i < BATCH; i++) {
+      my_free(blocks[order[i]]);
+    }
+  }
+  return (now_ns() - start) / ((double) ROUNDS * BATCH);
+}
+
+static double run_batch(size_t size) {
+  static void * shuffled[BATCH];
+  double start = now_ns();
+  for (int r = 0; r < ROUNDS; r++) {
+    size_t n = my_malloc_batch(size, BATCH, blocks);
+    if (n != BATCH) {
+      fprintf(stderr, "my_malloc_batch returned %zu blocks\n", n);
+      exit(1);
+    }
+    for (size_t i = 0; i < BATCH; i++) {
+      memset(blocks[i], 0, size);
+    }
+    for (size_t i = 0; i < BATCH; i++) {
+      shuffled[i] = blocks[order[i]];
+    }
+    my_free_batch(shuffled, BATCH);
+  }
+  return (now_ns() - start) / ((double) ROUNDS * BATCH);
+}
+
+int main() {
+  static const size_t sizes[] = { 16, 64, 256, 1024, 4096 };
+  srand(1);
+  shuffle_order();
+
+  printf("%8s %14s %14s\n", "size", "loop_ns", "batch_ns");
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    for (size_t i = 0; i < BATCH; i++) {
+      kept[i] = my_malloc(sizes[s]);
+    }
+    double loop = run_loop(sizes[s]);
+    double batch = run_batch(sizes[s]);
+    printf("%8zu %14.1f %14.1f\n", sizes[s], loop, batch);
+    for (size_t i = 0; i < BATCH; i++) {
+      my_free(kept[i]);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,74 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "myMalloc.h"
+
+/*
+ * Checks that my_calloc returns zeroed memory after trimming, on the main
+ * arena and on a non-main arena.
+ *
+ * Each thread fills a pool of blocks with 0xff, frees them so the arena can
+ * shrink, trims it and then takes blocks with my_calloc, which reuse the
+ * released memory and skip clearing what the allocator believes is fresh.
+ * Each block is dirtied again before the next one is taken. The program
+ * exits with status 1 if any block was not zero.
+ */
+
+#define N_BLOCKS 20000
+#define BLOCK_SIZE 1000
+#define N_CALLOCS 200
+#define CALLOC_SIZE 100000
+#define ROUNDS 4
+
+static void * blocks[N_BLOCKS];
+static void * callocs[N_CALLOCS];
+
+static size_t run() {
+  size_t nonzero = 0;
+  for (int r = 0; r < ROUNDS; r++) {
+    for (size_t i = 0; i < N_BLOCKS; i++) {
+      blocks[i] = my_malloc(BLOCK_SIZE);
+      memset(blocks[i], 0xff, BLOCK_SIZE);
+    }
+    for (size_t i = 0; i < N_BLOCKS; i++) {
+      my_free(blocks[i]);
+    }
+    my_malloc_trim(0);
+
+    for (size_t i = 0; i < N_CALLOCS; i++) {
+      unsigned char * p = my_calloc(1, CALLOC_SIZE);
+      for (size_t j = 0; j < CALLOC_SIZE; j++) {
+        if (p[j] != 0) {
+          nonzero++;
+          break;
+        }
+      }
+      memset(p, 0xff, CALLOC_SIZE);
+      callocs[i] = p;
+    }
+    for (size_t i = 0; i < N_CALLOCS; i++) {
+      my_free(callocs[i]);
+    }
+  }
+  return nonzero;
+}
+
+static void * worker(void * arg) {
+  *(size_t *) arg = run();
+  return NULL;
+}
+
+int main() {
+  size_t mainNonzero = run();
+
+  // The first thread after the main thread gets the first non-main arena
+  size_t threadNonzero = 0;
+  pthread_t thread;
+  pthread_create(&thread, NULL, worker, &threadNonzero);
+  pthread_join(thread, NULL);
+
+  printf("non-zero callocs: main arena %zu, non-main arena %zu of %d each\n",
+         mainNonzero, threadNonzero, ROUNDS * N_CALLOCS);
+  return mainNonzero + threadNonzero > 0;
+}
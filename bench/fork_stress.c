@@ -0,0 +1,130 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "myMalloc.h"
+
+/*
+ * Forks repeatedly while other threads allocate, free and hand blocks to
+ * each other as fast as they can, so the fork regularly lands while a lock
+ * of the allocator is held or a thread cache is being changed.
+ *
+ * Every child allocates from the forking thread and from a new thread of
+ * its own, checks its heap with verify() and exits. A child that does not
+ * finish within CHILD_TIMEOUT seconds is taken to be deadlocked. The
+ * program exits with status 1 if any child failed.
+ */
+
+#define N_THREADS 4
+#define N_FORKS 100
+#define N_SLOTS 4096
+#define CHILD_OPS 5000
+#define CHILD_TIMEOUT 10
+
+static void * volatile slots[N_SLOTS];
+static volatile bool stop;
+
+static unsigned long long next_random(unsigned long long * rng) {
+  *rng ^= *rng << 13;
+  *rng ^= *rng >> 7;
+  *rng ^= *rng << 17;
+  return *rng;
+}
+
+/* Replace random shared slots, freeing what other threads put there */
+static void churn(unsigned long long * rng, size_t ops, bool forever) {
+  for (size_t i = 0; forever ? !stop : i < ops; i++) {
+    unsigned long long r = next_random(rng);
+    size_t size = r % 16 == 0 ? r % 200000 : r % 600;
+    void * p;
+    switch ((r >> 20) % 4) {
+    case 0:
+      p = my_calloc(1, size);
+      break;
+    case 1:
+      p = my_realloc(my_malloc(size / 2 + 1), size);
+      break;
+    default:
+      p = my_malloc(size);
+      break;
+    }
+    if (p != NULL && size > 0) {
+      memset(p, 0x5a, size < 64 ? size : 64);
+    }
+    my_free(__atomic_exchange_n(&slots[(r >> 32) % N_SLOTS], p, __ATOMIC_ACQ_REL));
+  }
+}
+
+static void * worker(void * arg) {
+  unsigned long long rng = 88172645463325252ULL + (size_t) arg;
+  churn(&rng, 0, true);
+  return NULL;
+}
+
+static void * child_worker(void * arg) {
+  unsigned long long rng = (size_t) arg;
+  churn(&rng, CHILD_OPS, false);
+  return NULL;
+}
+
+static int run_child(int n) {
+  alarm(CHILD_TIMEOUT);
+  unsigned long long rng = 12345 + n;
+  churn(&rng, CHILD_OPS, false);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, child_worker, (void *) (size_t) (n + 1)) != 0) {
+    return 3;
+  }
+  pthread_join(thread, NULL);
+
+  for (size_t i = 0; i < N_SLOTS; i++) {
+    my_free(slots[i]);
+    slots[i] = NULL;
+  }
+  my_malloc_trim(0);
+  malloc_stats stats = my_malloc_stats();
+  if (stats.mallocs < stats.frees) {
+    return 4;
+  }
+  return verify() ? 0 : 2;
+}
+
+int main() {
+  pthread_t threads[N_THREADS];
+  for (size_t i = 0; i < N_THREADS; i++) {
+    pthread_create(&threads[i], NULL, worker, (void *) i);
+  }
+
+  int failed = 0;
+  int deadlocked = 0;
+  for (int n = 0; n < N_FORKS; n++) {
+    usleep(1000);
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      break;
+    }
+    if (pid == 0) {
+      _exit(run_child(n));
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM) {
+      deadlocked++;
+    } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      failed++;
+    }
+  }
+
+  stop = true;
+  for (int i = 0; i < N_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  printf("%d forks, %d deadlocked, %d failed\n", N_FORKS, deadlocked, failed);
+  return deadlocked + failed > 0;
+}
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "myMalloc.h"
+
+/*
+ * Measures how well the placement policy packs a long running workload.
+ *
+ * A fixed pseudo-random trace keeps a pool of live objects whose sizes are
+ * spread log-uniformly between 32 bytes and 64KiB. Most objects are short
+ * lived, a few live for the rest of the run, which pins the free space
+ * between them the way a long running process does. The program is built
+ * once per FIT_POLICY and replays the same trace, so the numbers are directly
+ * comparable.
+ *
+ * At the end of every phase it reports the heap size, the live bytes, the
+ * fragmentation (the share of the heap not holding live data), the number of
+ * free blocks and the largest free block.
+ */
+
+#define N_SLOTS 16384
+#define N_PHASES 8
+#define OPS_PER_PHASE 400000
+#define MIN_SHIFT 5
+#define MAX_SHIFT 16
+
+static void * slots[N_SLOTS];
+static size_t sizes[N_SLOTS];
+static unsigned long long rng = 88172645463325252ULL;
+
+static unsigned long long next_random() {
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng;
+}
+
+static size_t random_size() {
+  int shift = MIN_SHIFT + next_random() % (MAX_SHIFT - MIN_SHIFT);
+  return ((size_t) 1 << shift) + next_random() % ((size_t) 1 << shift);
+}
+
+static void report(int phase, size_t live) {
+  arena * a = &arenas[0];
+  size_t heap = (char *) sbrk(0) - (char *) base;
+  size_t nfree = 0;
+  size_t largest = 0;
+  for (int i = 0; i < N_LISTS; i++) {
+    header * freelist = &a->freelistSentinels[i];
+    for (header * cur = get_next(freelist); cur != freelist; cur = get_next(cur)) {
+      nfree++;
+      if (get_object_size(cur) > largest) {
+        largest = get_object_size(cur);
+      }
+    }
+  }
+  printf("%6d %12zu %12zu %8.1f%% %10zu %12zu\n", phase, heap, live,
+         100.0 * (heap - live) / heap, nfree, largest);
+}
+
+int main() {
+  // Every object must come from the main arena's freelists
+  my_mallopt(MY_M_MMAP_THRESHOLD, HEAP_SIZE / 2);
+  my_mallopt(MY_M_TRIM_THRESHOLD, 0);
+
+  printf("policy: %s\n", FIT_POLICY == FIT_BEST ? "best fit" : "first fit");
+  printf("%6s %12s %12s %9s %10s %12s\n", "phase", "heap", "live",
+         "frag", "free_blks", "largest_free");
+
+  size_t live = 0;
+  for (int phase = 1; phase <= N_PHASES; phase++) {
+    for (int op = 0; op < OPS_PER_PHASE; op++) {
+      size_t i = next_random() % N_SLOTS;
+      // One slot in 64 holds an object that is never freed
+      bool pinned = i % 64 == 0;
+      if (slots[i] != NULL && !pinned) {
+        my_free(slots[i]);
+        live -= sizes[i];
+        slots[i] = NULL;
+      } else if (slots[i] == NULL) {
+        sizes[i] = random_size();
+        slots[i] = my_malloc(sizes[i]);
+        if (slots[i] == NULL) {
+          fprintf(stderr, "out of memory\n");
+          return 1;
+        }
+        live += sizes[i];
+      }
+    }
+    report(phase, live);
+  }
+  return 0;
+}
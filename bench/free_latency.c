@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "myMalloc.h"
+
+/*
+ * Measures the cost of my_free as the freelist a block coalesces with grows.
+ *
+ * For each list length n, 2n blocks of the same size are allocated and every
+ * other one is freed, leaving n free blocks of one size class separated by
+ * allocated blocks. Freeing the remaining blocks then merges each one with its
+ * free neighbours, which has to unlink them from the long list. With constant
+ * time unlinking the time per free stays flat as n grows.
+ *
+ * The program is built with TCACHE_COUNT=0 so every free reaches the
+ * freelists instead of the thread cache, and trimming is off so no free pays
+ * for madvise.
+ */
+
+#define BLOCK_SIZE 64
+#define MAX_BLOCKS (1 << 17)
+
+static void * blocks[2 * MAX_BLOCKS];
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main() {
+  my_mallopt(MY_M_TRIM_THRESHOLD, 0);
+
+  printf("%10s %14s\n", "list_len", "ns_per_free");
+  for (size_t n = 256; n <= MAX_BLOCKS; n *= 2) {
+    for (size_t i = 0; i < 2 * n; i++) {
+      blocks[i] = my_malloc(BLOCK_SIZE);
+    }
+    // Blocks are prepended, so the lowest addresses end up at the tail of
+    // the list where a search from the sentinel would find them last
+    for (size_t i = 0; i < 2 * n; i += 2) {
+      my_free(blocks[i]);
+    }
+
+    double start = now_ns();
+    for (size_t i = 1; i < 2 * n; i += 2) {
+      my_free(blocks[i]);
+    }
+    double elapsed = now_ns() - start;
+
+    printf("%10zu %14.1f\n", n, elapsed / n);
+  }
+  return 0;
+}
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "myMalloc.h"
+
+/*
+ * Compares my_free against my_free_sized for sizes served from slabs, from
+ * the thread cache and from the freelists.
+ *
+ * Every round allocates BATCH blocks of one size and frees them in a
+ * shuffled order, once with each function. Only the frees are timed, and
+ * the two functions alternate between rounds so both see the same heap.
+ */
+
+#define BATCH 256
+#define ROUNDS 20000
+
+static void * blocks[BATCH];
+static size_t order[BATCH];
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void shuffle_order() {
+  for (size_t i = 0; i < BATCH; i++) {
+    order[i] = i;
+  }
+  for (size_t i = BATCH - 1; i > 0; i--) {
+    size_t j = rand() % (i + 1);
+    size_t t = order[i];
+    order[i] = order[j];
+    order[j] = t;
+  }
+}
+
+static double run(size_t size, bool sized) {
+  for (size_t i = 0; i < BATCH; i++) {
+    blocks[i] = my_malloc(size);
+    *(char *) blocks[i] = 1;
+  }
+  double start = now_ns();
+  if (sized) {
+    for (size_t i = 0; i < BATCH; i++) {
+      my_free_sized(blocks[order[i]], size);
+    }
+  } else {
+    for (size_t i = 0; i < BATCH; i++) {
+      my_free(blocks[order[i]]);
+    }
+  }
+  return now_ns() - start;
+}
+
+int main() {
+  static const size_t sizes[] = { 8, 32, 64, 200, 400, 1000, 4000 };
+  srand(1);
+  shuffle_order();
+
+  printf("%8s %14s %14s\n", "size", "free_ns", "free_sized_ns");
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    double plain = 0;
+    double sized = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+      plain += run(sizes[s], false);
+      sized += run(sizes[s], true);
+    }
+    printf("%8zu %14.2f %14.2f\n", sizes[s], plain / ((double) ROUNDS * BATCH),
+           sized / ((double) ROUNDS * BATCH));
+  }
+  return 0;
+}
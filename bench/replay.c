@@ -0,0 +1,307 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "myMalloc.h"
+
+/*
+ * Replays an allocation trace recorded with MALLOC_TRACE against my_malloc
+ * and reports the throughput, the latency percentiles of the calls and how
+ * the heap and the resident memory follow the live data over the run:
+ *
+ *   replay trace_file
+ *
+ * The calls of every thread are replayed in the order they were made by a
+ * single thread, as fast as possible. Blocks are renumbered before the run
+ * so a block is found by index instead of by its recorded address, and
+ * frees of blocks allocated before the trace started are skipped. Every
+ * page of an allocated block is written outside the timed call so the
+ * resident memory counts it.
+ */
+
+#define N_SAMPLES 20
+
+/*
+ * A call of the trace once its blocks are renumbered
+ *
+ * uint32_t op The trace_op of the call
+ * size_t id Index of the block returned, or freed for TRACE_FREE
+ * size_t old Index of the block a realloc resized, or NO_BLOCK
+ * size_t size Bytes requested
+ * size_t alignment Alignment of a memalign
+ */
+typedef struct call {
+  uint32_t op;
+  size_t id;
+  size_t old;
+  size_t size;
+  size_t alignment;
+} call;
+
+#define NO_BLOCK SIZE_MAX
+
+static trace_record * records;
+static call * calls;
+static size_t nrecords;
+static size_t ncalls;
+static size_t nblocks;
+
+/*
+ * Open addressing table from a recorded address to the index of the block
+ * that is live at it
+ */
+typedef struct slot {
+  uint64_t addr;
+  size_t id;
+} slot;
+
+static slot * table;
+static size_t tableMask;
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t hash_addr(uint64_t addr) {
+  return (addr * 0x9e3779b97f4a7c15ULL) >> 20 & tableMask;
+}
+
+static void table_put(uint64_t addr, size_t id) {
+  size_t i = hash_addr(addr);
+  while (table[i].addr != 0 && table[i].addr != addr) {
+    i = (i + 1) & tableMask;
+  }
+  table[i].addr = addr;
+  table[i].id = id;
+}
+
+/* Remove an address and return its block, or NO_BLOCK if it is not live */
+static size_t table_take(uint64_t addr) {
+  size_t i = hash_addr(addr);
+  while (table[i].addr != addr) {
+    if (table[i].addr == 0) {
+      return NO_BLOCK;
+    }
+    i = (i + 1) & tableMask;
+  }
+  size_t id = table[i].id;
+  // Shift the following entries of the cluster back over the hole
+  size_t hole = i;
+  for (size_t j = (i + 1) & tableMask; table[j].addr != 0; j = (j + 1) & tableMask) {
+    size_t home = hash_addr(table[j].addr);
+    if (((j - home) & tableMask) >= ((j - hole) & tableMask)) {
+      table[hole] = table[j];
+      hole = j;
+    }
+  }
+  table[hole].addr = 0;
+  return id;
+}
+
+static int by_seq(const void * a, const void * b) {
+  uint64_t x = ((const trace_record *) a)->seq;
+  uint64_t y = ((const trace_record *) b)->seq;
+  return x < y ? -1 : x > y;
+}
+
+static int by_value(const void * a, const void * b) {
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+static bool load_trace(const char * path) {
+  FILE * f = fopen(path, "rb");
+  if (f == NULL) {
+    perror(path);
+    return false;
+  }
+  trace_file_header fh;
+  if (fread(&fh, sizeof(fh), 1, f) != 1 ||
+      memcmp(fh.magic, TRACE_MAGIC, sizeof(fh.magic)) != 0 ||
+      fh.version != TRACE_VERSION || fh.record_size != sizeof(trace_record)) {
+    fprintf(stderr, "%s: not a trace of this version\n", path);
+    fclose(f);
+    return false;
+  }
+  fseek(f, 0, SEEK_END);
+  nrecords = (ftell(f) - sizeof(fh)) / sizeof(trace_record);
+  fseek(f, sizeof(fh), SEEK_SET);
+  records = malloc(nrecords * sizeof(trace_record) + 1);
+  if (records == NULL || fread(records, sizeof(trace_record), nrecords, f) != nrecords) {
+    fprintf(stderr, "%s: could not read %zu records\n", path, nrecords);
+    fclose(f);
+    return false;
+  }
+  fclose(f);
+  qsort(records, nrecords, sizeof(trace_record), by_seq);
+  return true;
+}
+
+/* Turn the records into calls on numbered blocks */
+static void renumber() {
+  size_t tableSize = 1024;
+  while (tableSize < 2 * nrecords) {
+    tableSize *= 2;
+  }
+  table = calloc(tableSize, sizeof(slot));
+  tableMask = tableSize - 1;
+  calls = malloc(nrecords * sizeof(call) + 1);
+
+  for (size_t i = 0; i < nrecords; i++) {
+    trace_record * r = &records[i];
+    call * c = &calls[ncalls];
+    c->op = r->op;
+    c->size = r->size;
+    c->old = NO_BLOCK;
+    c->alignment = 0;
+    switch (r->op) {
+    case TRACE_FREE:
+      c->id = table_take(r->ptr);
+      if (c->id == NO_BLOCK) {
+        continue;
+      }
+      break;
+    case TRACE_REALLOC:
+      // A resize of a block from before the trace replays as a malloc
+      c->old = table_take(r->arg);
+      c->id = nblocks++;
+      table_put(r->ptr, c->id);
+      break;
+    case TRACE_MEMALIGN:
+      c->alignment = r->arg;
+      // Fall through
+    default:
+      c->id = nblocks++;
+      table_put(r->ptr, c->id);
+      break;
+    }
+    ncalls++;
+  }
+  free(table);
+  free(records);
+}
+
+static size_t resident_bytes() {
+  size_t pages = 0;
+  size_t resident = 0;
+  FILE * f = fopen("/proc/self/statm", "r");
+  if (f != NULL) {
+    if (fscanf(f, "%zu %zu", &pages, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(f);
+  }
+  return resident * getpagesize();
+}
+
+static void touch(char * p, size_t size) {
+  for (size_t i = 0; i < size; i += 4096) {
+    p[i] = 1;
+  }
+}
+
+int main(int argc, char ** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s trace_file\n", argv[0]);
+    return 1;
+  }
+  if (!load_trace(argv[1])) {
+    return 1;
+  }
+  renumber();
+
+  char ** blocks = malloc((nblocks + 1) * sizeof(char *));
+  size_t * sizes = malloc((nblocks + 1) * sizeof(size_t));
+  double * latency = malloc(ncalls * sizeof(double) + 1);
+  if (blocks == NULL || sizes == NULL || latency == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  // The driver's own tables are resident before the replay starts
+  memset(blocks, 0, nblocks * sizeof(char *));
+  memset(sizes, 0, nblocks * sizeof(size_t));
+  memset(latency, 0, ncalls * sizeof(double));
+  size_t baseline = resident_bytes();
+
+  printf("%zu records, %zu calls on %zu blocks\n", nrecords, ncalls, nblocks);
+  printf("%12s %12s %12s %12s %9s\n", "calls", "live", "heap", "rss", "frag");
+
+  size_t live = 0;
+  size_t peakLive = 0;
+  size_t peakHeap = 0;
+  size_t peakRss = 0;
+  double peakFrag = 0;
+  double total = 0;
+  for (size_t i = 0; i < ncalls; i++) {
+    call * c = &calls[i];
+    char * p = NULL;
+    double start = now_ns();
+    switch (c->op) {
+    case TRACE_MALLOC:
+      p = my_malloc(c->size);
+      break;
+    case TRACE_CALLOC:
+      p = my_calloc(1, c->size);
+      break;
+    case TRACE_MEMALIGN:
+      p = my_memalign(c->alignment, c->size);
+      break;
+    case TRACE_REALLOC:
+      p = my_realloc(c->old == NO_BLOCK ? NULL : blocks[c->old], c->size);
+      break;
+    case TRACE_FREE:
+      my_free(blocks[c->id]);
+      break;
+    }
+    latency[i] = now_ns() - start;
+    total += latency[i];
+
+    if (c->op == TRACE_FREE) {
+      live -= sizes[c->id];
+      blocks[c->id] = NULL;
+    } else if (p != NULL) {
+      if (c->old != NO_BLOCK) {
+        live -= sizes[c->old];
+        blocks[c->old] = NULL;
+      }
+      touch(p, c->size);
+      blocks[c->id] = p;
+      sizes[c->id] = c->size;
+      live += c->size;
+    }
+    if (live > peakLive) {
+      peakLive = live;
+    }
+
+    if ((i + 1) % (ncalls / N_SAMPLES + 1) == 0 || i + 1 == ncalls) {
+      malloc_stats stats = my_malloc_stats();
+      size_t rss = resident_bytes() - baseline;
+      double frag = stats.os_bytes ? 100.0 * (stats.os_bytes - live) / stats.os_bytes : 0;
+      printf("%12zu %12zu %12zu %12zu %8.1f%%\n", i + 1, live, stats.os_bytes, rss, frag);
+      if (stats.os_bytes > peakHeap) {
+        peakHeap = stats.os_bytes;
+        peakFrag = frag;
+      }
+      if (rss > peakRss) {
+        peakRss = rss;
+      }
+    }
+  }
+
+  qsort(latency, ncalls, sizeof(double), by_value);
+  printf("throughput: %.2f Mcalls/s\n", ncalls / total * 1e3);
+  if (ncalls > 0) {
+    printf("latency ns: p50 %.0f p90 %.0f p99 %.0f p99.9 %.0f max %.0f\n",
+           latency[ncalls / 2], latency[ncalls * 9 / 10], latency[ncalls * 99 / 100],
+           latency[ncalls * 999 / 1000], latency[ncalls - 1]);
+  }
+  printf("peak live %zu, peak heap %zu at %.1f%% fragmentation, peak rss %zu\n",
+         peakLive, peakHeap, peakFrag, peakRss);
+  return 0;
+}
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "myMalloc.h"
+
+/*
+ * Measures the memory the slabs save on a workload of tiny objects.
+ *
+ * A fixed pseudo-random trace keeps a pool of live objects of 1 to 32 bytes,
+ * the sizes slabs serve by default. Each phase replaces random objects, then
+ * the pool shrinks to a tenth and grows back, so the numbers show both the
+ * steady state and how much memory lingers after a drop. The program is
+ * built once with the default SLAB_MAX_SIZE and once with slabs disabled and
+ * replays the same trace, so the numbers are directly comparable.
+ *
+ * At the end of every phase it reports the live bytes, the memory the
+ * allocator holds from the OS, the resident memory and the share of the
+ * resident memory not holding live data.
+ */
+
+#define N_SLOTS (1 << 21)
+#define N_PHASES 6
+#define OPS_PER_PHASE (4 * N_SLOTS)
+#define MAX_SIZE 32
+
+static void * slots[N_SLOTS];
+static unsigned char sizes[N_SLOTS];
+static unsigned long long rng = 88172645463325252ULL;
+
+static unsigned long long next_random() {
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng;
+}
+
+static size_t resident_bytes() {
+  size_t pages = 0;
+  size_t resident = 0;
+  FILE * f = fopen("/proc/self/statm", "r");
+  if (f != NULL) {
+    if (fscanf(f, "%zu %zu", &pages, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(f);
+  }
+  return resident * getpagesize();
+}
+
+static void report(const char * phase, size_t live, size_t baseline) {
+  malloc_stats stats = my_malloc_stats();
+  size_t rss = resident_bytes() - baseline;
+  printf("%-8s %12zu %12zu %12zu %8.1f%%\n", phase, live, stats.os_bytes, rss,
+         rss ? 100.0 * (rss - live) / rss : 0);
+}
+
+/* Fill or replace objects in the first n slots */
+static size_t churn(size_t n, size_t ops, size_t live) {
+  for (size_t op = 0; op < ops; op++) {
+    size_t i = next_random() % n;
+    if (slots[i] != NULL) {
+      my_free(slots[i]);
+      live -= sizes[i];
+    }
+    sizes[i] = 1 + next_random() % MAX_SIZE;
+    slots[i] = my_malloc(sizes[i]);
+    *(char *) slots[i] = 1;
+    live += sizes[i];
+  }
+  return live;
+}
+
+int main() {
+  // The driver's own tables are resident before the run starts
+  for (size_t i = 0; i < N_SLOTS; i++) {
+    slots[i] = NULL;
+    sizes[i] = 0;
+  }
+  size_t baseline = resident_bytes();
+
+  printf("slabs: %s\n", SLAB_MAX_SIZE > 0 ? "on" : "off");
+  printf("%-8s %12s %12s %12s %9s\n", "phase", "live", "heap", "rss", "overhead");
+
+  size_t live = 0;
+  for (int phase = 1; phase <= N_PHASES; phase++) {
+    live = churn(N_SLOTS, OPS_PER_PHASE / N_PHASES, live);
+    char name[16];
+    snprintf(name, sizeof(name), "churn%d", phase);
+    report(name, live, baseline);
+  }
+
+  for (size_t i = N_SLOTS / 10; i < N_SLOTS; i++) {
+    my_free(slots[i]);
+    live -= sizes[i];
+    slots[i] = NULL;
+  }
+  my_malloc_trim(0);
+  report("shrunk", live, baseline);
+
+  live = churn(N_SLOTS, OPS_PER_PHASE / N_PHASES, live);
+  report("regrown", live, baseline);
+  return 0;
+}
@@ -0,0 +1,354 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "myMalloc.h"
+
+/*
+ * Runs the standard allocator workloads at 1 up to N threads, doubling the
+ * count and finishing at N, against my_malloc and the system malloc:
+ *
+ *   suite [max_threads [calls_per_thread]]
+ *
+ * fixed     each thread frees and reallocates 64 byte blocks in a window of
+ *           256 live blocks
+ * random    the same with sizes spread log-uniformly over 8 bytes to 8KiB
+ *           and a window of 1024 blocks
+ * prodcons  every thread allocates blocks and passes them through a ring to
+ *           the next thread, which frees them
+ * larson    server simulation: each round new threads take over the live
+ *           blocks of the previous round's threads, replacing random ones
+ * realloc   two buffers per thread grow together by small steps up to 64KiB
+ *
+ * Both allocators are called through function pointers. Every call counts
+ * as an operation and one call in SAMPLE_EVERY is timed for the latency
+ * percentiles. Blocks still live at the end of a run are freed untimed.
+ */
+
+#define MAX_THREADS 64
+#define SAMPLE_EVERY 8
+#define DEFAULT_CALLS 400000
+
+#define FIXED_WINDOW 256
+#define FIXED_SIZE 64
+#define RANDOM_WINDOW 1024
+#define RING_SIZE 1024
+#define LARSON_WINDOW 1024
+#define LARSON_ROUNDS 8
+#define REALLOC_LIMIT (64 * 1024)
+
+typedef struct allocator {
+  const char * name;
+  void * (*malloc)(size_t);
+  void (*free)(void *);
+  void * (*realloc)(void *, size_t);
+} allocator;
+
+static const allocator allocators[] = {
+  { "my_malloc", my_malloc, my_free, my_realloc },
+  { "system", malloc, free, realloc },
+};
+
+/*
+ * State of one thread of a run
+ *
+ * const allocator * alloc Allocator under test
+ * int id Index of the thread in the run
+ * int nthreads Number of threads in the run
+ * int round Round of a workload that runs in several rounds
+ * size_t calls Calls made so far
+ * size_t limit Calls to make in total
+ * double * samples Timed call latencies in nanoseconds
+ * size_t nsamples Number of timed calls
+ * unsigned long long rng State of the thread's random number generator
+ */
+typedef struct worker {
+  const allocator * alloc;
+  int id;
+  int nthreads;
+  int round;
+  size_t calls;
+  size_t limit;
+  double * samples;
+  size_t nsamples;
+  unsigned long long rng;
+  pthread_t thread;
+} worker;
+
+typedef struct workload {
+  const char * name;
+  void (*run)(worker * w);
+  int rounds;
+} workload;
+
+/*
+ * Single producer single consumer ring of blocks between two threads
+ */
+typedef struct ring {
+  void * slots[RING_SIZE];
+  size_t head __attribute__ ((aligned (64)));
+  size_t tail __attribute__ ((aligned (64)));
+} ring;
+
+static ring rings[MAX_THREADS];
+static void ** larsonSlots[MAX_THREADS];
+static worker workers[MAX_THREADS];
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned long long next_random(worker * w) {
+  w->rng ^= w->rng << 13;
+  w->rng ^= w->rng >> 7;
+  w->rng ^= w->rng << 17;
+  return w->rng;
+}
+
+static size_t log_uniform(worker * w, int minShift, int maxShift) {
+  int shift = minShift + next_random(w) % (maxShift - minShift);
+  return ((size_t) 1 << shift) + next_random(w) % ((size_t) 1 << shift);
+}
+
+static inline bool sample(worker * w) {
+  return w->calls++ % SAMPLE_EVERY == 0;
+}
+
+static void * timed_malloc(worker * w, size_t size) {
+  if (!sample(w)) {
+    return w->alloc->malloc(size);
+  }
+  double start = now_ns();
+  void * p = w->alloc->malloc(size);
+  w->samples[w->nsamples++] = now_ns() - start;
+  return p;
+}
+
+static void timed_free(worker * w, void * p) {
+  if (!sample(w)) {
+    w->alloc->free(p);
+    return;
+  }
+  double start = now_ns();
+  w->alloc->free(p);
+  w->samples[w->nsamples++] = now_ns() - start;
+}
+
+static void * timed_realloc(worker * w, void * p, size_t size) {
+  if (!sample(w)) {
+    return w->alloc->realloc(p, size);
+  }
+  double start = now_ns();
+  void * q = w->alloc->realloc(p, size);
+  w->samples[w->nsamples++] = now_ns() - start;
+  return q;
+}
+
+static void churn(worker * w, size_t window, bool fixed) {
+  void ** slots = calloc(window, sizeof(void *));
+  while (w->calls < w->limit) {
+    size_t i = next_random(w) % window;
+    if (slots[i] != NULL) {
+      timed_free(w, slots[i]);
+    }
+    size_t size = fixed ? FIXED_SIZE : log_uniform(w, 3, 13);
+    slots[i] = timed_malloc(w, size);
+    *(char *) slots[i] = 1;
+  }
+  for (size_t i = 0; i < window; i++) {
+    w->alloc->free(slots[i]);
+  }
+  free(slots);
+}
+
+static void fixed_churn(worker * w) {
+  churn(w, FIXED_WINDOW, true);
+}
+
+static void random_churn(worker * w) {
+  churn(w, RANDOM_WINDOW, false);
+}
+
+static void producer_consumer(worker * w) {
+  ring * out = &rings[w->id];
+  ring * in = &rings[(w->id + w->nthreads - 1) % w->nthreads];
+  size_t blocks = w->limit / 2;
+  size_t produced = 0;
+  size_t consumed = 0;
+  while (produced < blocks || consumed < blocks) {
+    bool progress = false;
+    size_t tail = __atomic_load_n(&out->tail, __ATOMIC_RELAXED);
+    if (produced < blocks &&
+        tail - __atomic_load_n(&out->head, __ATOMIC_ACQUIRE) < RING_SIZE) {
+      progress = true;
+      void * p = timed_malloc(w, log_uniform(w, 4, 10));
+      *(char *) p = 1;
+      out->slots[tail % RING_SIZE] = p;
+      __atomic_store_n(&out->tail, tail + 1, __ATOMIC_RELEASE);
+      produced++;
+    }
+    size_t head = __atomic_load_n(&in->head, __ATOMIC_RELAXED);
+    if (head != __atomic_load_n(&in->tail, __ATOMIC_ACQUIRE)) {
+      timed_free(w, in->slots[head % RING_SIZE]);
+      __atomic_store_n(&in->head, head + 1, __ATOMIC_RELEASE);
+      consumed++;
+      progress = true;
+    }
+    if (!progress) {
+      // Let the neighbours run when there are fewer CPUs than threads
+      sched_yield();
+    }
+  }
+}
+
+static void larson(worker * w) {
+  // Every round a thread takes over the blocks of another thread of the
+  // previous round
+  int which = (w->id + w->round) % w->nthreads;
+  if (larsonSlots[which] == NULL) {
+    larsonSlots[which] = calloc(LARSON_WINDOW, sizeof(void *));
+  }
+  void ** slots = larsonSlots[which];
+  size_t limit = w->limit * (w->round + 1) / LARSON_ROUNDS;
+  while (w->calls < limit) {
+    size_t i = next_random(w) % LARSON_WINDOW;
+    if (slots[i] != NULL) {
+      timed_free(w, slots[i]);
+    }
+    slots[i] = timed_malloc(w, 16 + next_random(w) % 1009);
+    *(char *) slots[i] = 1;
+  }
+  if (w->round == LARSON_ROUNDS - 1) {
+    for (size_t i = 0; i < LARSON_WINDOW; i++) {
+      w->alloc->free(slots[i]);
+    }
+    free(slots);
+    larsonSlots[which] = NULL;
+  }
+}
+
+static void realloc_growth(worker * w) {
+  while (w->calls < w->limit) {
+    char * a = timed_malloc(w, 16);
+    char * b = timed_malloc(w, 16);
+    size_t sizeA = 16;
+    size_t sizeB = 16;
+    while ((sizeA < REALLOC_LIMIT || sizeB < REALLOC_LIMIT) && w->calls < w->limit) {
+      if (sizeA < REALLOC_LIMIT) {
+        sizeA += 16 + next_random(w) % 241;
+        a = timed_realloc(w, a, sizeA);
+        a[sizeA - 1] = 1;
+      }
+      if (sizeB < REALLOC_LIMIT) {
+        sizeB += 16 + next_random(w) % 241;
+        b = timed_realloc(w, b, sizeB);
+        b[sizeB - 1] = 1;
+      }
+    }
+    timed_free(w, a);
+    timed_free(w, b);
+  }
+}
+
+static const workload workloads[] = {
+  { "fixed", fixed_churn, 1 },
+  { "random", random_churn, 1 },
+  { "prodcons", producer_consumer, 1 },
+  { "larson", larson, LARSON_ROUNDS },
+  { "realloc", realloc_growth, 1 },
+};
+
+static const workload * currentWorkload;
+
+static void * run_worker(void * arg) {
+  worker * w = (worker *) arg;
+  currentWorkload->run(w);
+  return NULL;
+}
+
+static int by_value(const void * a, const void * b) {
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+static void run(const workload * wl, const allocator * alloc, int nthreads,
+                size_t calls) {
+  currentWorkload = wl;
+  // Workloads may finish the step they are in after reaching the limit
+  size_t maxSamples = calls / SAMPLE_EVERY + 8;
+  for (int i = 0; i < nthreads; i++) {
+    worker * w = &workers[i];
+    memset(w, 0, sizeof(*w));
+    w->alloc = alloc;
+    w->id = i;
+    w->nthreads = nthreads;
+    w->limit = calls;
+    w->samples = malloc(maxSamples * sizeof(double));
+    w->rng = 88172645463325252ULL + i;
+  }
+  memset(rings, 0, sizeof(rings));
+
+  double start = now_ns();
+  for (int r = 0; r < wl->rounds; r++) {
+    for (int i = 0; i < nthreads; i++) {
+      workers[i].round = r;
+      pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+    }
+    for (int i = 0; i < nthreads; i++) {
+      pthread_join(workers[i].thread, NULL);
+    }
+  }
+  double elapsed = now_ns() - start;
+
+  size_t total = 0;
+  size_t nsamples = 0;
+  for (int i = 0; i < nthreads; i++) {
+    total += workers[i].calls;
+    nsamples += workers[i].nsamples;
+  }
+  double * samples = malloc((nsamples + 1) * sizeof(double));
+  nsamples = 0;
+  for (int i = 0; i < nthreads; i++) {
+    memcpy(samples + nsamples, workers[i].samples, workers[i].nsamples * sizeof(double));
+    nsamples += workers[i].nsamples;
+    free(workers[i].samples);
+  }
+  qsort(samples, nsamples, sizeof(double), by_value);
+  printf("%-9s %-10s %7d %10.2f %8.0f %8.0f %8.0f\n", wl->name, alloc->name,
+         nthreads, total / elapsed * 1e3, samples[nsamples / 2],
+         samples[nsamples * 99 / 100], samples[nsamples * 999 / 1000]);
+  fflush(stdout);
+  free(samples);
+}
+
+int main(int argc, char ** argv) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int maxThreads = argc > 1 ? atoi(argv[1]) : (cpus < 16 ? cpus : 16);
+  size_t calls = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_CALLS;
+  if (maxThreads < 1 || maxThreads > MAX_THREADS || calls < 2) {
+    fprintf(stderr, "usage: %s [max_threads (1-%d) [calls_per_thread]]\n",
+            argv[0], MAX_THREADS);
+    return 1;
+  }
+
+  printf("%-9s %-10s %7s %10s %8s %8s %8s\n", "workload", "allocator",
+         "threads", "Mops/s", "p50_ns", "p99_ns", "p999_ns");
+  for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+    for (int t = 1; ; t = t * 2 < maxThreads ? t * 2 : maxThreads) {
+      for (size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++) {
+        run(&workloads[i], &allocators[a], t, calls);
+      }
+      if (t == maxThreads) {
+        break;
+      }
+    }
+  }
+  return 0;
+}
@@ -1,14 +1,27 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "myMalloc.h"
 #include "printing.h"
 
+#ifndef MADV_FREE
+  // Kernels without lazy freeing drop the pages right away
+  #define MADV_FREE MADV_DONTNEED
+#endif
+
 /* Due to the way assert() prints error messges we use out own assert function
  * for deteminism when testing assertions
  */
@@ -25,32 +38,237 @@
 #endif
 
 /*
- * Mutex to ensure thread safety for the freelist
+ * Non-main arenas can not share the program break, so each one carves its
+ * chunks out of HEAP_SIZE aligned regions mapped from the OS. The start of
+ * each region records the owning arena so a block in a non-main arena can be
+ * traced back to it from its address alone. Memory from clean to the end of
+ * the region is known to read as zero, it was never handed out or its pages
+ * were dropped by a trim.
+ */
+typedef struct heap_info {
+  arena * owner;
+  char * top;
+  char * end;
+  char * clean;
+} heap_info;
+
+/* Bytes at the start of a region taken by its heap_info */
+#define HEAP_INFO_SIZE ((sizeof(heap_info) + 15) & ~(size_t) 15)
+
+/*
+ * A slab is a SLAB_SIZE aligned page of same-size objects without headers,
+ * packed right after this descriptor. Set bits in freeSlots mark the free
+ * slots. The slab of an object is found by rounding its address down, and
+ * every slab lives in one reserved region so the test for a slab object is a
+ * range check.
+ */
+#define SLAB_BITMAP_WORDS ((SLAB_SIZE / MALLOC_ALIGNMENT + 63) / 64)
+
+typedef struct slab {
+  struct slab * next;
+  struct slab * prev;
+  arena * owner;
+  unsigned size;
+  unsigned nslots;
+  unsigned nfree;
+  uint64_t freeSlots[SLAB_BITMAP_WORDS];
+} slab;
+
+/* Offset of the first object in a slab */
+#define SLAB_HEADER_SIZE ((sizeof(slab) + 15) & ~(size_t) 15)
+
+/*
+ * Region reserved for the slabs at startup, slabs are handed out from it in
+ * address order. NULL if the reservation failed.
+ */
+static char * slabRegion;
+static size_t slabRegionUsed;
+
+/*
+ * Per-thread cache of blocks for the exact size freelists. Cached blocks keep
+ * their ALLOCATED state in the heap so their neighbours never coalesce with
+ * them, and are chained through their next pointer. The caches in use are
+ * linked into a list so a forked child can reclaim the blocks cached by
+ * threads that do not exist in it.
+ */
+typedef struct tcache {
+  header * lists[N_TCACHE_LISTS];
+  unsigned counts[N_TCACHE_LISTS];
+  void * slabLists[N_SLAB_CLASSES];
+  unsigned slabCounts[N_SLAB_CLASSES];
+  struct tcache * next;
+  struct tcache * prev;
+  bool registered;
+  bool disabled;
+} tcache;
+
+static __thread tcache threadCache;
+static tcache tcacheList = { .next = &tcacheList, .prev = &tcacheList };
+static pthread_mutex_t tcacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Key whose destructor drains a thread's cache when the thread exits
+ */
+static pthread_key_t tcacheKey;
+
+/*
+ * The arenas, each with its own lock, freelists and chunks. Arena 0 is the
+ * main arena and grows the heap with sbrk.
+ */
+arena arenas[N_ARENAS];
+
+/*
+ * Mutex serializing the lazy initialization of the non-main arenas
+ */
+static pthread_mutex_t arenasMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Arena the calling thread allocates from, assigned round-robin on the
+ * thread's first allocation
+ */
+static __thread arena * threadArena;
+static unsigned nextArena;
+
+/*
+ * Requests of at least this many bytes get their own mapping from the OS,
+ * tunable at runtime through my_mallopt
+ */
+static size_t mmapThreshold = MMAP_THRESHOLD;
+
+/*
+ * Upper bound on the size of the chunks arenas request from the OS, tunable
+ * at runtime through my_mallopt
+ */
+static size_t maxChunkSize = MAX_CHUNK_SIZE;
+
+/*
+ * Freeing a block of at least this many bytes releases its memory to the OS,
+ * 0 disables automatic trimming. Tunable at runtime through my_mallopt
+ */
+static size_t trimThreshold = TRIM_THRESHOLD;
+
+/*
+ * Bytes and number of the blocks currently mapped on their own
+ */
+static size_t mmappedBytes;
+static size_t mmappedBlocks;
+
+/*
+ * Guard-page debug mode. About one allocation in guardSample, none while it
+ * is 0, is served from pages of its own by guard_malloc. Each thread counts
+ * down a random interval to its next guarded allocation. Freed guarded
+ * blocks stay mapped but inaccessible in a ring under guardMutex, and the
+ * oldest is unmapped when a new one takes its place.
+ */
+typedef struct guard_mapping {
+  char * mem;
+  size_t size;
+} guard_mapping;
+
+static size_t guardSample;
+static __thread size_t guardCountdown;
+static __thread uint64_t guardRng;
+static guard_mapping guardQuarantine[GUARD_QUARANTINE];
+static size_t guardFreed;
+static pthread_mutex_t guardMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Per-thread operation counters. Only the owning thread writes them, so
+ * counting costs a plain increment. Live threads are linked into a list for
+ * my_malloc_stats, whose sentinel accumulates the counts of exited threads.
+ */
+typedef struct thread_stats {
+  size_t mallocs;
+  size_t frees;
+  size_t reallocs;
+  struct thread_stats * next;
+  struct thread_stats * prev;
+  bool active;
+  bool retired;
+} thread_stats;
+
+static __thread thread_stats threadStats;
+static thread_stats statsList = { .next = &statsList, .prev = &statsList };
+static pthread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Key whose destructor folds a thread's counters into statsList on exit
+ */
+static pthread_key_t statsKey;
+
+/*
+ * Trace recorder state. Each thread buffers its records in memory mapped for
+ * it and appends them to the trace file under traceMutex when the buffer
+ * fills or the thread exits. traceFd is -1 while no trace is being recorded.
+ */
+typedef struct trace_buffer {
+  uint32_t thread;
+  size_t count;
+  trace_record records[TRACE_BUFFER_RECORDS];
+} trace_buffer;
+
+static int traceFd = -1;
+static pthread_mutex_t traceMutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t traceSeq;
+static uint64_t traceStart;
+static uint32_t traceThreads;
+static __thread trace_buffer * traceBuffer;
+
+/*
+ * Key whose destructor writes out a thread's trace records on exit
+ */
+static pthread_key_t traceKey;
+
+/*
+ * Heap profiler state. Each thread counts down the bytes it allocates to its
+ * next sample, drawn from an exponential distribution with a mean of
+ * profileRate bytes, 0 while sampling is off. The live samples are kept in
+ * an open addressing table under profileMutex. A counter per bucket of
+ * addresses lets frees of blocks that were never sampled skip the lock.
  */
-static pthread_mutex_t mutex;
+#define PROFILE_FILTER_SIZE 65536
+
+typedef struct profile_sample {
+  uintptr_t ptr;
+  size_t size;
+  size_t depth;
+  void * frames[PROFILE_MAX_FRAMES];
+} profile_sample;
+
+static size_t profileRate;
+static size_t profileLive;
+static uint16_t profileFilter[PROFILE_FILTER_SIZE];
+static pthread_mutex_t profileMutex = PTHREAD_MUTEX_INITIALIZER;
+static profile_sample * profileTable;
+static size_t profileCapacity;
+static __thread ssize_t profileCountdown;
+static __thread uint64_t profileRng;
+static __thread bool profileBusy;
 
 /*
- * Array of sentinel nodes for the freelists
+ * Profiles requested by PROFILE_SIGNAL are written to profilePath followed
+ * by the process id and the number of the profile
  */
-header freelistSentinels[N_LISTS];
+static char profilePath[4096];
+static bool profileRequested;
+static unsigned profileDumps;
 
 /*
- * Pointer to the second fencepost in the most recently allocated chunk from
- * the OS. Used for coalescing chunks
+ * Smallest block size held by each freelist, generated at startup from the
+ * size class parameters
  */
-header * lastFencePost;
+static size_t sizeClasses[N_LISTS];
 
 /*
  * Pointer to maintian the base of the heap to allow printing based on the
  * distance from the base of the heap
- */ 
+ */
 void * base;
 
 /*
- * List of chunks allocated by  the OS for printing boundary tags
+ * Key of the header checksums and link obfuscation of hardened builds
  */
-header * osChunkList [MAX_OS_CHUNKS];
-size_t numOsChunks = 0;
+uintptr_t hardenedKey;
 
 /*
  * direct the compiler to run the init function before running main
@@ -58,6 +276,13 @@ size_t numOsChunks = 0;
  */
 static void init (void) __attribute__ ((constructor));
 
+/*
+ * Makes the allocator initialize exactly once, from the constructor or from
+ * the first allocation when another library's constructor allocates before
+ * ours has run
+ */
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+
 // Helper functions for manipulating pointers to headers
 static inline header * get_header_from_offset(void * ptr, ptrdiff_t off);
 static inline header * get_left_header(header * h);
@@ -65,29 +290,120 @@ static inline header * ptr_to_header(void * p);
 
 // Helper functions for allocating more memory from the OS
 static inline void initialize_fencepost(header * fp, size_t object_left_size);
-static inline void insert_os_chunk(header * hdr);
+static inline bool reserve_os_chunk(arena * a);
+static inline void insert_os_chunk(arena * a, header * hdr);
 static inline void insert_fenceposts(void * raw_mem, size_t size);
-static header * allocate_chunk(size_t size);
+static header * allocate_chunk(arena * a, size_t size);
+static header * grow_heap(arena * a, size_t newsize);
+
+// Helper functions for objects mapped directly from the OS
+static header * allocate_mmapped(size_t raw_size);
+static void deallocate_mmapped(header * hdr);
+
+// Helper functions for the guard-page debug mode
+static inline bool guard_sampled(size_t raw_size);
+static header * guard_malloc(size_t raw_size);
+static void guard_free(header * hdr);
+
+// Helper functions for returning memory to the OS
+static bool trim_top(arena * a, size_t pad);
+static size_t release_block_pages(header * hdr, int advice);
+static inline bool pages_released(size_t size);
+static inline void trim_after_free(arena * a, header * hdr, char * start, char * end);
+
+// Helper functions for aligned allocation
+static header * allocate_aligned(arena * a, size_t alignment, size_t raw_size);
+static header * allocate_mmapped_aligned(size_t alignment, size_t raw_size);
+
+// Helper functions for resizing a block in place
+static void shrink_block(arena * a, header * hdr, size_t newsize);
+static bool grow_block(arena * a, header * hdr, size_t newsize);
+static header * remap_mmapped(header * hdr, size_t raw_size);
+
+// Helper functions for managing arenas
+static void arena_init(arena * a);
+static inline arena * get_arena();
+static inline arena * block_arena(header * hdr);
 
 // Helper functions for freeing a block
-static inline void deallocate_object(void * p);
+static inline void deallocate_object(arena * a, void * p);
+static inline void free_block(void * p);
+static inline void push_remote_free(arena * a, void * p);
+static inline void drain_remote_frees(arena * a);
 
 // Helper functions for allocating a block
-static inline header * allocate_object(size_t raw_size);
+static inline header * allocate_object(arena * a, size_t raw_size, bool * zeroed);
+static inline header * find_block(arena * a, size_t newsize);
+
+// Helper functions for the per-thread caches
+static inline header * tcache_get(arena * a, size_t raw_size);
+static inline bool tcache_put(arena * a, header * hdr);
+static inline bool tcache_put_list(arena * a, header * hdr, int list, bool check);
+static inline void tcache_check_double_free(tcache * tc, header * hdr);
+static void tcache_drain(void * arg);
+
+// Helper functions for the slabs of tiny objects
+static inline bool is_slab(void * p);
+static inline slab * ptr_to_slab(void * p);
+static void * slab_alloc(arena * a, int cls);
+static void slab_free(arena * a, slab * s, void * p);
+static void slab_tcache_flush(arena * a, tcache * tc, int cls, unsigned n);
+static void * slab_malloc(size_t raw_size);
+static void slab_release(void * p);
+
+// Helper functions for the operation counters
+static inline void count_op(size_t offset, size_t n);
+static void stats_retire(void * arg);
+
+// Helper functions for the trace recorder
+static inline void trace_op(enum trace_op op, void * ptr, uint64_t arg, size_t size);
+static void trace_flush(trace_buffer * tb);
+static void trace_retire(void * arg);
+static void trace_exit() __attribute__ ((destructor));
+
+// Helper functions for the checks of hardened builds
+static void report_corruption(const char * msg);
+static inline bool is_arena(arena * a);
+static bool in_os_chunk(arena * a, header * hdr);
+static void check_free(header * hdr);
+static inline void check_neighbours(header * hdr);
+static inline void * get_link(void * p);
+static inline void set_link(void * p, void * next);
+static void init_hardened_key();
+
+// Helper functions for the heap profiler
+static inline void profile_malloc(void * ptr, size_t size);
+static inline void profile_free(void * ptr);
+static void profile_malloc_slow(void * ptr, size_t size) __attribute__ ((noinline));
+static void profile_free_slow(void * ptr);
+static void profile_signal(int sig);
 
 // Helper functions for verifying that the data structures are structurally 
 // valid
-static inline header * detect_cycles();
-static inline header * verify_pointers();
-static inline bool verify_freelist();
+static inline header * detect_cycles(arena * a);
+static inline header * verify_pointers(arena * a);
+static inline bool verify_freelist(arena * a);
 static inline header * verify_chunk(header * chunk);
-static inline bool verify_tags();
-static inline void addtolist(header * freelist, int list);
+static inline bool verify_tags(arena * a);
+static inline bool verify_slabs(arena * a);
+static inline bool verify_arena(arena * a);
+static inline void check_block(header * hdr);
+static inline void check_heap(arena * a);
+static inline void addtolist(arena * a, header * freelist, int list);
 static void init();
+static void initialize_allocator();
+static inline void ensure_initialized();
+
+// Helper functions for keeping the locks consistent across fork
+static void fork_prepare();
+static void fork_parent();
+static void fork_child();
+static void fork_reclaim_threads();
 
 static bool isMallocInitialized;
 
 static inline int find_free(size_t size);
+static void init_size_classes();
 /**
  * @brief Helper function to retrieve a header pointer from a pointer and an 
  *        offset
@@ -136,15 +452,56 @@ inline static void initialize_fencepost(header * fp, size_t object_left_size) {
 	fp->object_left_size = object_left_size;
 }
 
+/**
+ * @brief Make room in the list of chunks from the OS for one more chunk.
+ * Called before a chunk is requested so a chunk that can not be recorded is
+ * never handed out.
+ *
+ * @param a the arena the chunk will belong to
+ *
+ * @return true if the list has room, false if it could not be grown
+ */
+inline static bool reserve_os_chunk(arena * a) {
+  if (a->numOsChunks < a->maxOsChunks) {
+    return true;
+  }
+  // The lists are mapped directly since malloc can not be used while the
+  // arena is locked. They double so they are rarely remapped.
+  size_t max = a->maxOsChunks ? 2 * a->maxOsChunks
+                              : getpagesize() / sizeof(header *);
+  header ** list = mmap(NULL, 2 * max * sizeof(header *), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (list == MAP_FAILED) {
+    return false;
+  }
+  if (a->osChunkList != NULL) {
+    memcpy(list, a->osChunkList, a->numOsChunks * sizeof(header *));
+    memcpy(list + max, a->osChunkEnds, a->numOsChunks * sizeof(header *));
+    if (!MALLOC_HARDENED) {
+      munmap(a->osChunkList, 2 * a->maxOsChunks * sizeof(header *));
+    }
+  }
+  __atomic_store_n(&a->osChunkEnds, list + max, __ATOMIC_RELEASE);
+  __atomic_store_n(&a->osChunkList, list, __ATOMIC_RELEASE);
+  a->maxOsChunks = max;
+  return true;
+}
+
 /**
  * @brief Helper function to maintain list of chunks from the OS for debugging
+ * and for checking freed blocks. Must be called before lastFencePost moves to
+ * the new chunk, as it becomes the end of the previous chunk, and after
+ * reserve_os_chunk succeeded.
  *
+ * @param a the arena the chunk belongs to
  * @param hdr the first fencepost in the chunk allocated by the OS
  */
-inline static void insert_os_chunk(header * hdr) {
-  if (numOsChunks < MAX_OS_CHUNKS) {
-    osChunkList[numOsChunks++] = hdr;
+inline static void insert_os_chunk(arena * a, header * hdr) {
+  if (a->numOsChunks > 0) {
+    a->osChunkEnds[a->numOsChunks - 1] = a->lastFencePost;
   }
+  a->osChunkList[a->numOsChunks] = hdr;
+  __atomic_store_n(&a->numOsChunks, a->numOsChunks + 1, __ATOMIC_RELEASE);
 }
 static void printlist(){
 	header * first = get_right_header(base);
@@ -155,13 +512,13 @@ static void printlist(){
 		first = get_right_header(first);
 	}
 	for(int x = 0; x < N_LISTS; x++){
-		header * pie = &freelistSentinels[x];
-		if(pie-> next != pie){
+		header * pie = &arenas[0].freelistSentinels[x];
+		if(get_next(pie) != pie){
 			print_object(pie);
-			print_object(pie->next);
+			print_object(get_next(pie));
 		}
 	}
-			
+
 }
 /**
  * @brief given a chunk of memory insert fenceposts at the left and 
@@ -185,583 +542,3436 @@ inline static void insert_fenceposts(void * raw_mem, size_t size) {
 }
 
 /**
- * @brief Allocate another chunk from the OS and prepare to insert it
- * into the free list
- *
- * @param size The size to allocate from the OS
+ * @brief Mark a freelist as non-empty in the freelist bitmap
  *
- * @return A pointer to the allocable block in the chunk (just after the 
- * first fencpost)
+ * @param a the arena owning the freelist
+ * @param list the index of the freelist
  */
-static void remove_list(header * freelist, size_t original_size){
-	if(original_size > 496){
-//		exit(0);
-	}
-	header * former = &freelistSentinels[find_free(original_size)];
-	while(former -> next != freelist){
-		former = former -> next;
-	}
-	former -> next = freelist -> next;
-	former -> next -> prev = former;
-	//addtolist(freelist, find_free(get_object_size(freelist)));
-}
-static header * isCombine(header * freelist){
-	//print_object(lastFencePost);
-	
-	header * delFence2 = get_left_header(freelist);
-	header * delFence1 = get_left_header(delFence2);
-	header * reset = &freelistSentinels[N_LISTS -1];
-	//set_object_state(freelist,1);
-	numOsChunks--;
-	size_t size = get_object_size(freelist);
-	set_object_state(delFence1,0);	
-	set_object_size(delFence1,get_object_size(freelist) + 32);
-	get_right_header(delFence1) -> object_left_size = get_object_size(delFence1);
-		
-	addtolist(delFence1,find_free(get_object_size(delFence1)));
-	if (verify_pointers() != NULL){
-		exit(0);
-	}
-	lastFencePost = get_right_header(get_right_header(delFence1));
-	return get_right_header(delFence1);
-	
-	
-		
-	
-	
-}
-static header * combineleft(header * freelist, header * lefto){
-	//print_object(freelist->next);
-	//print_object(lefto->next);
-	//exit(0);
-	int flag = 0;
-	if(get_object_size(lefto) > 496){
-		flag = 1;
-	}
-	remove_list(freelist,get_object_size(freelist));
-	if(flag != 1){
-		remove_list(lefto,get_object_size(lefto));
-	}
-	set_object_size(lefto,get_object_size(lefto) + get_object_size(freelist));
-	header * righto = get_right_header(lefto);
-	righto-> object_left_size = get_object_size(lefto);
-	if(flag != 1){
-	addtolist(lefto,find_free(get_object_size(lefto)));
-	}
-	//printlist();
-	return lefto;
+static inline void set_bitmap(arena * a, int list) {
+  a->freelist_bitmap[list >> 3] |= (char) (1 << (list & 7));
 }
-static header * allocate_block(size_t newsize, header * freelist, int counter){
-	//print_object(get_left_header(freelist));
-	if(get_object_state(get_left_header(freelist))==UNALLOCATED && get_object_size(get_left_header(freelist)) != 0){
-		freelist = combineleft(freelist,get_left_header(freelist));
-	}
-	header * lol = get_header_from_offset(freelist, get_object_size(freelist) -newsize);
-	set_object_size(lol, newsize);
-	size_t size = get_object_size(freelist);
-	lol->object_left_size = get_object_size(freelist) - newsize;
-	set_object_size(freelist,get_object_size(freelist) - newsize);
-	//lol-> object_left_size = get_object_size(get_left_header(lol));
-	get_right_header(lol) -> object_left_size = newsize;
-	set_object_state(lol, ALLOCATED);
 
-	if (counter == 1){
-		int nextlist = find_free(get_object_size(freelist));
-		if(verify_tags()){
-			exit(0);
-		}
-		header * newfree = &freelistSentinels[nextlist];
-		//print_object(newfree);
-		
-		if(get_object_state(get_right_header(lastFencePost) )!= 2){
-			if(get_object_size(freelist) < 496){
-				remove_list(freelist,size);
-				addtolist(freelist,find_free(get_object_size(freelist)));
-			}		
-		}
-		else{
-			
-			remove_list(freelist,size);
-			isCombine(freelist);
-			
-		}
-			
-		//isCombine(freelist);	
-		if (verify_freelist() ==false){
-			exit(0);
-		}
-		if(verify_tags()){
-			exit(0);
-		}
-		if(detect_cycles() != NULL){
-			exit(0);
-		}
-		
-		//print_object(get_left_header(lol)->next);	
-		//print_object(get_left_header(get_left_header(lol))->next);
-		//exit(0);
-		
-		if(get_object_state(get_left_header(get_left_header(lol)))==UNALLOCATED && get_object_size(get_left_header(get_left_header(lol)))!=0){
-			//exit(0);
-			combineleft(get_left_header(lol),get_left_header(get_left_header(lol)));
-			//printlist();
-		}
-		//print_object(&freelistSentinels[N_LISTS-1]);
-		return lol;
-	}
-	if(get_object_size(freelist) < 496){
-		//exit(0);
-		remove_list(freelist, size);
-		addtolist(freelist,find_free(get_object_size(freelist)));
-	}
-//	print_object(get_right_header(base));
-	if(verify_freelist() ==false){
-		exit(0);
-	}
-	if(detect_cycles() != NULL){
-		exit(0);
-	}
-	header * freelistfinder = &freelistSentinels[5];
-	//print_object(freelistfinder);
-	//print_object(base);
-	return lol ;
-}
-	
-static header * allocate_chunk(size_t size) {
-  void * mem = sbrk(size);
-  
-  insert_fenceposts(mem, size);
-  header * hdr = (header *) ((char *)mem + ALLOC_HEADER_SIZE);
-  set_object_state(hdr, UNALLOCATED);
-  set_object_size(hdr, size - 2 * ALLOC_HEADER_SIZE);
-  hdr->object_left_size = ALLOC_HEADER_SIZE;
-  return hdr;
+/**
+ * @brief Mark a freelist as empty in the freelist bitmap
+ *
+ * @param a the arena owning the freelist
+ * @param list the index of the freelist
+ */
+static inline void clear_bitmap(arena * a, int list) {
+  a->freelist_bitmap[list >> 3] &= (char) ~(1 << (list & 7));
 }
-//hello
+
 /**
- * @brief Helper allocate an object given a raw request size from the user
+ * @brief Find the first non-empty freelist at or after a given index using
+ * the freelist bitmap
  *
- * @param raw_size number of bytes the user needs
+ * @param a the arena to search
+ * @param list the index of the smallest acceptable freelist
  *
- * @return A block satisfying the user's request
+ * @return the index of the first non-empty freelist or N_LISTS if every
+ * remaining list is empty
  */
-static inline header * allocate_object(size_t raw_size) {
-  // TODO implement allocation
-  size_t newsize;
-  //if(raw_size == 100){
-//	exit(0);
-  //}
-  if(raw_size == 0){
-	return NULL;
-  }
-  else if(raw_size >= ARENA_SIZE){
-	return NULL;
-  }
-  else if(raw_size < ALLOC_HEADER_SIZE){
-	newsize = 2 *ALLOC_HEADER_SIZE;
+static inline int next_nonempty_list(arena * a, int list) {
+  int byte = list >> 3;
+  if (byte >= BITMAP_SIZE) {
+    return N_LISTS;
   }
-  else if(raw_size % 8 != 0){
-	int diff = raw_size % 8;
-	newsize = raw_size + (8-diff) + ALLOC_HEADER_SIZE;
-  }
-  else{
-	newsize = raw_size + ALLOC_HEADER_SIZE;
-  } 
-  
-  //TODO find freelists
-  header * curfree = &freelistSentinels[N_LISTS-1];
-  header * freelist = curfree -> next;
-  int flag = 0;
-  int cnt = 0;
-  for(int i = 0; i < N_LISTS; i++){
-	header * nextFree = &freelistSentinels[i];
-	//print_object(nextFree -> next);
-	//print_object(nextFree);
-	if(nextFree -> prev != nextFree){
-		header * counter = nextFree;
-		while(counter -> prev != nextFree){
-			if(get_object_size((counter -> prev)) >= newsize && flag ==0){
-	//			print_object(counter -> prev);
-  				curfree = &freelistSentinels[i];
-  				freelist = counter->prev;
-				flag = 1;
-		
-			}
-			if(get_object_size(counter -> prev) >= 480){
-				//print_object(counter -> next);
-			}
-			counter = counter -> prev;
-			
-		}
-	}
-	else{
-		if(get_object_size((nextFree -> prev)) >= newsize && flag ==0){
-			curfree = &freelistSentinels[i];
-			freelist = curfree-> prev;
-			flag = 1;
-		}
-	}
-	cnt = i;
-   }
-   flag = 0;
-   //if(cnt = N_LISTS-1){
-//	header * free = curfree;
-//	while(free -> prev != curfree){
-//		if(newsize == get_object_size(free->prev) && flag ==0){
-//			freelist = free -> prev;
-//			flag = 1;
-//		}
-//		free = free-> prev;
-//	}
-   //}
-   //print_object(freelist); 
-  
-  
-  //printf("%ld/n",newsize);
-  //exit(0);
-  //print_object(freelist); 
-  if(get_object_size(freelist) == newsize){
-	header * newspace = freelist->prev;
-	
-	//newspace -> next = newspace;
-	//newspace -> prev = newspace;
-	remove_list(freelist,get_object_size(freelist));
-	
-	//freelist -> next = get_right_header(freelist);
-        //freelist -> prev = get_left_header(freelist);
-	set_object_state(freelist,ALLOCATED);	
-	set_object_size(freelist, newsize);
-	//newspace -> next = newspace;
-	//newspace -> prev = newspace;
-	return (header *)freelist->data;
-  }
-  else if(newsize < get_object_size(freelist)){
-  	return (header *)allocate_block(newsize, freelist,2)->data;
+  unsigned bits = (unsigned char) a->freelist_bitmap[byte] & (0xffu << (list & 7));
+  while (bits == 0) {
+    if (++byte >= BITMAP_SIZE) {
+      return N_LISTS;
+    }
+    bits = (unsigned char) a->freelist_bitmap[byte];
   }
-  else{
-//	exit(0);
-	//print_object(freelist);
-	//printf("\n%ld\n", newsize);
-	//exit(0);	
-	int nextlist = find_free(get_object_size(freelist));
-	//header * testfence = get_right_header(get_right_header(freelist));
-	header * block = allocate_chunk(ARENA_SIZE);
-	header * firstfence = get_left_header(block);
-	insert_os_chunk(firstfence);
-	nextlist = find_free(get_object_size(block));
-	addtolist(block,nextlist);
-	if (verify_pointers()){
-		exit(0);
-	}	
-		
-	return (header *)(allocate_block(newsize,block,1)->data);
-	
-	
-	}
-	
-  
-   
-  
-  
-  
-
+  return (byte << 3) + __builtin_ctz(bits);
 }
-int find_free(size_t size){
-	if (size < 496){
-		return size/8 -3;
+
+/**
+ * @brief Unlink a block from the freelist it is stored in using its own
+ * prev and next pointers, so removal costs the same for any list length
+ *
+ * @param a the arena owning the block
+ * @param freelist the block to remove
+ */
+static inline void remove_list(arena * a, header * freelist){
+	header * former = get_prev(freelist);
+	header * latter = get_next(freelist);
+	if (MALLOC_HARDENED && (get_next(former) != freelist || get_prev(latter) != freelist)) {
+		report_corruption("Corrupt Free List Detected");
 	}
-	else{
-		return N_LISTS -1;
+	set_next(former, latter);
+	set_prev(latter, former);
+	// Only the sentinel is left when the neighbours are the same node
+	if (former == latter) {
+		clear_bitmap(a, former - a->freelistSentinels);
 	}
 }
 
 /**
- * @brief Helper to get the header from a pointer allocated with malloc
+ * @brief Merge a free block with the free block to its left, keeping the
+ * merged block in the freelist matching its new size
  *
- * @param p pointer to the data region of the block
+ * @param a the arena owning both blocks
+ * @param freelist the free block on the right (not in any freelist)
+ * @param lefto the free block on the left (in a freelist)
  *
- * @return A pointer to the header of the block
+ * @return the merged block
  */
-static inline header * ptr_to_header(void * p) {
-  return (header *)((char *) p - ALLOC_HEADER_SIZE); //sizeof(header));
+static header * combineleft(arena * a, header * freelist, header * lefto){
+	size_t leftsize = get_object_size(lefto);
+	size_t size = leftsize + get_object_size(freelist);
+	int oldlist = find_free(leftsize);
+	int newlist = find_free(size);
+	if (oldlist != newlist) {
+		remove_list(a, lefto);
+	}
+	set_object_size(lefto, size);
+	get_right_header(lefto) -> object_left_size = size;
+	if (oldlist != newlist) {
+		addtolist(a, lefto, newlist);
+	}
+	return lefto;
 }
 
 /**
- * @brief Helper to manage deallocation of a pointer returned by the user
+ * @brief Coalesce a new chunk from the OS with the previous chunk when it
+ * starts directly after it. The two fenceposts between the chunks become part
+ * of the free space.
  *
- * @param p The pointer returned to the user by a call to malloc
+ * @param a the arena that grew
+ * @param block the allocable block of the new chunk (not in any freelist)
+ *
+ * @return the free block covering the new space, already in a freelist
  */
-static inline void addtolist(header * lol, int findfree1){
-	header * freelist = &freelistSentinels[findfree1];
-	if(freelist -> next != freelist){
-		
-		header * next1 = freelist -> next;
-		freelist -> next = lol;
-		lol -> prev = freelist;
-		next1 -> prev = lol;
-		lol -> next = next1;
+static header * isCombine(arena * a, header * block){
+	header * merged = a->lastFencePost;
+	set_block_object_size_and_state(merged,
+	    get_object_size(block) + 2 * ALLOC_HEADER_SIZE, UNALLOCATED);
+	get_right_header(merged) -> object_left_size = get_object_size(merged);
+	if (MALLOC_HARDENED) {
+		check_neighbours(merged);
 	}
-	else{
-		freelist -> next = lol;
-		lol -> prev = freelist;
-		freelist -> prev = lol;
-		lol -> next = freelist;
+
+	header * lefto = get_left_header(merged);
+	if (get_object_state(lefto) == UNALLOCATED) {
+		return combineleft(a, merged, lefto);
 	}
+	addtolist(a, merged, find_free(get_object_size(merged)));
+	return merged;
+}
+
+/**
+ * @brief Remove a block from the arena's range of memory known to be zero,
+ * keeping the larger part of the range left on either side of the block
+ *
+ * @param a the arena owning the block, locked by the caller
+ * @param hdr the block that is being handed out
+ *
+ * @return true if the block's data was inside the range and so reads as zero
+ */
+static inline bool take_zero_range(arena * a, header * hdr) {
+  char * start = (char *) hdr;
+  char * end = (char *) get_right_header(hdr);
+  if (end <= a->zeroStart || start >= a->zeroEnd) {
+    return false;
+  }
+  bool zero = (char *) hdr->data >= a->zeroStart && end <= a->zeroEnd;
+  if (start - a->zeroStart >= a->zeroEnd - end) {
+    a->zeroEnd = start > a->zeroStart ? start : a->zeroStart;
+  } else {
+    a->zeroStart = end;
+  }
+  return zero;
 }
-static inline void deallocate_object(void * p) {
-  // TODO implement deallocation
- 
-  if (p != NULL){
-	header * lol = get_header_from_offset((header *)p, -ALLOC_HEADER_SIZE);
-	//if(get_object_size(lol) == 128){
-	//	exit(0);
-	//}
-	if(get_object_state(lol) == UNALLOCATED){
-		printf("%s\n", "Double Free Detected");
-		assert(0);
+
+/**
+ * @brief Carve an allocated block of newsize bytes out of a free block. The
+ * allocated block is taken from the right end so the remaining free block
+ * keeps its header in place.
+ *
+ * @param a the arena owning the free block
+ * @param newsize the size of the block to allocate including metadata
+ * @param freelist a free block of at least newsize bytes
+ * @param zeroed if not NULL, set to whether the block's data is known to be
+ * zero
+ *
+ * @return the allocated block
+ */
+static header * allocate_block(arena * a, size_t newsize, header * freelist,
+                               bool * zeroed){
+	if (!header_intact(freelist)) {
+		report_corruption("Corrupt Header Detected");
 	}
-	int currentfreelist = find_free(get_object_size(lol));
-	
-	if(get_object_state(get_right_header(lol))!=UNALLOCATED && get_object_state(get_left_header(lol))!=UNALLOCATED){
-		set_object_state(lol,UNALLOCATED);
-		addtolist(lol,currentfreelist);
-		//if(get_object_size(lol) == 128){
-	//		exit(0);
-		//}
+	size_t size = get_object_size(freelist);
+	if (size - newsize < sizeof(header)) {
+		// The remainder could not hold a free block so hand out all of it
+		remove_list(a, freelist);
+		set_object_state(freelist, ALLOCATED);
+		bool zero = take_zero_range(a, freelist);
+		if (zeroed != NULL) {
+			*zeroed = zero;
 		}
-	else if(get_object_state(get_right_header(lol))!=UNALLOCATED && get_object_state(get_left_header(lol))==UNALLOCATED){
-		header * lefto = get_left_header(lol);
-		size_t left = get_object_size(lefto);
-		set_object_state(lol,UNALLOCATED);
-		set_object_size(lefto, get_object_size(lol) +get_object_size(lefto));
-		get_right_header(lefto) -> object_left_size = get_object_size(lefto);
-		
-		header * former = &freelistSentinels[find_free(get_object_size(lefto) - get_object_size(lol))];
-		while(former -> next != lefto){
-			former = former -> next;
-		}	
-		former -> next = lefto -> next;
-		former -> next -> prev = former;
-		addtolist(lefto, find_free(get_object_size(lefto)));
-		//if(get_object_size(lefto) == 128){
-		//	exit(0);
-		//}
-		//exit(0);
+		return freelist;
 	}
-	else if(get_object_state(get_right_header(lol))==UNALLOCATED && get_object_state(get_left_header(lol))!=UNALLOCATED){
-		header * righto = get_right_header(lol);
-		set_object_state(lol,UNALLOCATED);
-		set_object_size(lol,get_object_size(lol) + get_object_size(righto));
-		
-		addtolist(lol, find_free(get_object_size(lol)));
-		header * former = &freelistSentinels[find_free(get_object_size(righto))];
-		while(former -> next != righto){
-			former = former -> next;
-		}
-		former -> next = righto -> next;
-		former -> next -> prev = former;
-		get_right_header(lol) -> object_left_size = get_object_size(lol);	
-		//if(get_object_size(lol) == 128){
-	//		exit(0);
-		//}	
-			
+
+	size_t remainder = size - newsize;
+	header * lol = get_header_from_offset(freelist, remainder);
+	lol -> object_size_and_state = freelist -> object_size_and_state & NON_MAIN_ARENA;
+	set_block_object_size_and_state(lol, newsize, ALLOCATED);
+	lol -> object_left_size = remainder;
+	get_right_header(lol) -> object_left_size = newsize;
+
+	int oldlist = find_free(size);
+	int newlist = find_free(remainder);
+	if (oldlist != newlist) {
+		remove_list(a, freelist);
 	}
-	else{
-		
-		header * righto = get_right_header(lol);
-		header * lefto = get_left_header(lol);
-		size_t size = get_object_size(lefto);
-		set_object_state(lol, UNALLOCATED);
-		set_object_size(lefto, get_object_size(lol) + get_object_size(lefto) + get_object_size(righto));
-		get_right_header(lefto) -> object_left_size = get_object_size(lefto);
-		header * former = &freelistSentinels[find_free(get_object_size(righto))];
-		//remove_list(lefto, size);
-		//addtolist(lefto,find_free(get_object_size(lefto)));
-		while(former -> next != righto){
-			former = former -> next;
-		}
-		former -> next = righto -> next;
-		former -> next -> prev = former;
-		//if(get_object_size(lefto) == 128){
-		//	exit(0);
-		//}
+	set_object_size(freelist, remainder);
+	if (oldlist != newlist) {
+		addtolist(a, freelist, newlist);
 	}
-}
+	bool zero = take_zero_range(a, lol);
+	if (zeroed != NULL) {
+		*zeroed = zero;
+	}
+	return lol;
 }
 
 /**
- * @brief Helper to detect cycles in the free list
- * https://en.wikipedia.org/wiki/Cycle_detection#Floyd's_Tortoise_and_Hare
+ * @brief Map a new HEAP_SIZE aligned region for a non-main arena
  *
- * @return One of the nodes in the cycle or NULL if no cycle is present
+ * @param a the arena that will own the region
+ *
+ * @return the region's heap_info or NULL if the OS is out of memory
  */
-static inline header * detect_cycles() {
-  for (int i = 0; i < N_LISTS; i++) {
-    header * freelist = &freelistSentinels[i];
-    for (header * slow = freelist->next, * fast = freelist->next->next; 
-         fast != freelist; 
-         slow = slow->next, fast = fast->next->next) {
-      if (slow == fast) {
-        return slow;
-      }
-    }
+static heap_info * new_heap(arena * a) {
+  // Over-map so an aligned region of HEAP_SIZE bytes is guaranteed to fit,
+  // then unmap the slack on either side
+  char * mem = mmap(NULL, 2 * HEAP_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED) {
+    return NULL;
   }
-  return NULL;
+  char * aligned = (char *) (((uintptr_t) mem + HEAP_SIZE - 1) & ~(uintptr_t) (HEAP_SIZE - 1));
+  if (aligned != mem) {
+    munmap(mem, aligned - mem);
+  }
+  munmap(aligned + HEAP_SIZE, mem + HEAP_SIZE - aligned);
+
+  heap_info * h = (heap_info *) aligned;
+  h->owner = a;
+  h->top = aligned + HEAP_INFO_SIZE;
+  h->end = aligned + HEAP_SIZE;
+  h->clean = h->top;
+  return h;
 }
 
 /**
- * @brief Helper to verify that there are no unlinked previous or next pointers
- *        in the free list
+ * @brief Take size bytes from the current region of a non-main arena, the
+ * equivalent of sbrk for arenas that can not use the program break
  *
- * @return A node whose previous and next pointers are incorrect or NULL if no
- *         such node exists
+ * @param a the arena to grow
+ * @param size the number of bytes needed
+ *
+ * @return the start of the memory or NULL if the OS is out of memory or no
+ * region can hold size bytes
  */
-static inline header * verify_pointers() {
-  for (int i = 0; i < N_LISTS; i++) {
-    header * freelist = &freelistSentinels[i];
-    for (header * cur = freelist->next; cur != freelist; cur = cur->next) {
-      if (cur->next->prev != cur || cur->prev->next != cur) {
-        return cur;
-      }
+static void * heap_sbrk(arena * a, size_t size) {
+  if (size > HEAP_SIZE - HEAP_INFO_SIZE) {
+    return NULL;
+  }
+  heap_info * h = a->currentHeap;
+  if (h == NULL || (size_t) (h->end - h->top) < size) {
+    h = new_heap(a);
+    if (h == NULL) {
+      return NULL;
     }
+    a->currentHeap = h;
   }
-  return NULL;
+  void * mem = h->top;
+  h->top += size;
+  return mem; 
 }
 
 /**
- * @brief Verify the structure of the free list is correct by checkin for 
- *        cycles and misdirected pointers
+ * @brief Allocate another chunk from the OS and prepare to insert it
+ * into the free list
  *
- * @return true if the list is valid
+ * @param a the arena the chunk is for
+ * @param size The size to allocate from the OS
+ *
+ * @return A pointer to the allocable block in the chunk (just after the 
+ * first fencpost)
  */
-static inline bool verify_freelist() {
-  header * cycle = detect_cycles();
-  if (cycle != NULL) {
-    fprintf(stderr, "Cycle Detected\n");
-    print_sublist(print_object, cycle->next, cycle);
-    return false;
+static header * allocate_chunk(arena * a, size_t size) {
+  void * mem;
+  // Start of the memory known to read as zero
+  char * clean;
+  if (a == &arenas[0]) {
+    // Someone else may have moved the break to an unaligned address
+    size_t misalign = (uintptr_t) sbrk(0) & (MALLOC_ALIGNMENT - 1);
+    if (misalign != 0 && sbrk(MALLOC_ALIGNMENT - misalign) == (void *) -1) {
+      return NULL;
+    }
+    mem = sbrk(size);
+    if (mem == (void *) -1) {
+      return NULL;
+    }
+    // The kernel hands out zeroed pages past the old break
+    clean = mem;
+  } else {
+    mem = heap_sbrk(a, size);
+    if (mem == NULL) {
+      return NULL;
+    }
+    clean = a->currentHeap->clean;
   }
 
-  header * invalid = verify_pointers();
-  if (invalid != NULL) {
-    fprintf(stderr, "Invalid pointers\n");
-    print_object(invalid);
-    return false;
-  }
+  // Every header in a non-main arena carries the NON_MAIN_ARENA bit
+  size_t flag = a == &arenas[0] ? 0 : NON_MAIN_ARENA;
+  header * hdr = (header *) ((char *)mem + ALLOC_HEADER_SIZE);
+  header * rightFencePost = get_header_from_offset(mem, size - ALLOC_HEADER_SIZE);
+  ((header *) mem)->object_size_and_state = flag;
+  hdr->object_size_and_state = flag;
+  rightFencePost->object_size_and_state = flag;
 
-  return true;
+  insert_fenceposts(mem, size);
+  set_object_state(hdr, UNALLOCATED);
+  set_object_size(hdr, size - 2 * ALLOC_HEADER_SIZE);
+  hdr->object_left_size = ALLOC_HEADER_SIZE;
+
+  // Fresh memory from the OS reads as zero apart from the headers. Only whole
+  // pages past the free block's links are trusted, as the end of the break may
+  // have been lowered into a page that still holds old data, and memory of a
+  // region below its clean mark may hold data of blocks freed before.
+  uintptr_t page = getpagesize();
+  a->zeroStart = (char *) (((uintptr_t) hdr + sizeof(header) + page - 1) & ~(page - 1));
+  if (a->zeroStart < clean) {
+    a->zeroStart = clean;
+  }
+  a->zeroEnd = (char *) rightFencePost;
+  if (a->zeroStart > a->zeroEnd) {
+    a->zeroStart = a->zeroEnd;
+  }
+  return hdr;
 }
 
 /**
- * @brief Helper to verify that the sizes in a chunk from the OS are correct
- *        and that allocated node's canary values are correct
+ * @brief Grow an arena by a new chunk that can hold a block of newsize bytes,
+ * coalescing with the previous chunk when the memory is contiguous. Chunk
+ * sizes double on every growth up to the maximum chunk size so a ramp-up
+ * needs few calls to the OS, and are never smaller than the request rounded
+ * up to ARENA_SIZE.
  *
- * @param chunk AREA_SIZE chunk allocated from the OS
+ * @param a the arena to grow
+ * @param newsize the size of the block that must fit including metadata
  *
- * @return a pointer to an invalid header or NULL if all header's are valid
+ * @return a free block of at least newsize bytes, already in a freelist, or
+ * NULL if the OS is out of memory
  */
-static inline header * verify_chunk(header * chunk) {
-	if (get_object_state(chunk) != FENCEPOST) {
-		fprintf(stderr, "Invalid fencepost\n");
-		print_object(chunk);
-		return chunk;
+static header * grow_heap(arena * a, size_t newsize) {
+  // A chunk that is not coalesced needs an entry in the list of chunks
+  if (!reserve_os_chunk(a)) {
+    return NULL;
+  }
+
+  size_t max = __atomic_load_n(&maxChunkSize, __ATOMIC_RELAXED);
+  size_t need = (newsize + 2 * ALLOC_HEADER_SIZE + ARENA_SIZE - 1)
+                & ~(size_t) (ARENA_SIZE - 1);
+  size_t size = a->nextChunkSize < max ? a->nextChunkSize : max;
+  if (size < need) {
+    size = need;
+  }
+  if (a->nextChunkSize < max) {
+    a->nextChunkSize *= 2;
+  }
+
+  header * block = allocate_chunk(a, size);
+  if (block == NULL) {
+    return NULL;
+  }
+
+  header * firstfence = get_left_header(block);
+  if (a->lastFencePost != NULL &&
+      get_header_from_offset(a->lastFencePost, ALLOC_HEADER_SIZE) == firstfence) {
+    block = isCombine(a, block);
+  } else {
+    insert_os_chunk(a, firstfence);
+    addtolist(a, block, find_free(get_object_size(block)));
+  }
+  a->lastFencePost = get_right_header(block);
+  return block;
+}
+
+/**
+ * @brief Probe the head of a freelist for the smallest block of at least
+ * newsize bytes, stopping early on an exact fit
+ *
+ * @param sentinel the sentinel of the freelist
+ * @param newsize the size of the block including metadata
+ *
+ * @return the best block among the first BEST_FIT_PROBES or NULL if none
+ * of them fits
+ */
+static inline header * probe_best_fit(header * sentinel, size_t newsize) {
+  header * best = NULL;
+  int probes = 0;
+  for (header * cur = get_next(sentinel); cur != sentinel && probes < BEST_FIT_PROBES;
+       cur = get_next(cur), probes++) {
+    size_t size = get_object_size(cur);
+    if (size >= newsize && (best == NULL || size < get_object_size(best))) {
+      best = cur;
+      if (size == newsize) {
+        break;
+      }
+    }
+  }
+  return best;
+}
+
+/**
+ * @brief Find a free block of at least newsize bytes. Every block in a list
+ * whose smallest size fits the request will do, so the bitmap finds one in
+ * constant time. With first fit the request's own list is only scanned when
+ * it holds a range of sizes and no larger block is free. With best fit a
+ * bounded number of blocks of the request's own list is probed first, then
+ * of the first larger list.
+ *
+ * @param a the arena to search
+ * @param newsize the size of the block including metadata
+ *
+ * @return a free block or NULL if no freelist holds one large enough
+ */
+static inline header * find_block(arena * a, size_t newsize) {
+  int list = find_free(newsize);
+  int first = sizeClasses[list] >= newsize ? list : list + 1;
+  header * sentinel = &a->freelistSentinels[list];
+
+  if (FIT_POLICY == FIT_BEST && first != list) {
+    header * best = probe_best_fit(sentinel, newsize);
+    if (best != NULL) {
+      return best;
+    }
+  }
+
+  int i = next_nonempty_list(a, first);
+  if (i < N_LISTS) {
+    if (FIT_POLICY == FIT_BEST && i >= N_EXACT_LISTS) {
+      return probe_best_fit(&a->freelistSentinels[i], newsize);
+    }
+    return get_next(&a->freelistSentinels[i]);
+  }
+
+  if (first != list) {
+    for (header * cur = get_next(sentinel); cur != sentinel; cur = get_next(cur)) {
+      if (get_object_size(cur) >= newsize) {
+        return cur;
+      }
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Round a user request up to the size of the block that holds it
+ *
+ * @param raw_size number of bytes the user needs
+ *
+ * @return the block size including metadata or 0 if the request can not be
+ * served
+ */
+static inline size_t request_size(size_t raw_size) {
+  size_t newsize;
+  if(raw_size == 0){
+	return 0;
+  }
+  else if(raw_size > SIZE_MAX - 2 * ARENA_SIZE){
+	return 0;
+  }
+  else if(raw_size < ALLOC_HEADER_SIZE){
+	newsize = 2 *ALLOC_HEADER_SIZE;
+  }
+  else{
+	// Keeping every block size a multiple of the alignment keeps the data
+	// of every block aligned
+	newsize = ((raw_size + MALLOC_ALIGNMENT - 1) & ~(size_t) (MALLOC_ALIGNMENT - 1))
+	          + ALLOC_HEADER_SIZE;
+  }
+  return newsize;
+}
+
+/**
+ * @brief Carve up to n blocks for requests of raw_size bytes out of as few
+ * free blocks as possible. A free block large enough for the whole batch, or
+ * for as much of it as fits in a chunk of the maximum chunk size, is found or
+ * the heap grown to make one, and the blocks are split off it back to back.
+ *
+ * @param a the arena to allocate from, locked by the caller
+ * @param raw_size number of bytes the user needs per block
+ * @param n the number of blocks
+ * @param out array receiving the user's memory of each block
+ *
+ * @return the number of blocks allocated
+ */
+static size_t allocate_batch(arena * a, size_t raw_size, size_t n, void ** out) {
+  size_t newsize = request_size(raw_size);
+  if (newsize == 0) {
+    return 0;
+  }
+
+  // Growing by more than a chunk would waste most of a non-main arena's
+  // region, so large batches are filled from several regions
+  size_t max = __atomic_load_n(&maxChunkSize, __ATOMIC_RELAXED) - 2 * ALLOC_HEADER_SIZE;
+  size_t perRegion = newsize < max ? max / newsize : 1;
+
+  size_t count = 0;
+  while (count < n) {
+    size_t want = n - count;
+    if (want > perRegion) {
+      want = perRegion;
+    }
+    header * region = find_block(a, want * newsize);
+    if (region == NULL) {
+      region = grow_heap(a, want * newsize);
+    }
+    if (region == NULL) {
+      // Settle for a block that fits a single request
+      region = find_block(a, newsize);
+      if (region == NULL) {
+        region = grow_heap(a, newsize);
+      }
+      if (region == NULL) {
+        return count;
+      }
+    }
+
+    while (count < n && get_object_size(region) >= newsize) {
+      header * hdr = allocate_block(a, newsize, region, NULL);
+      if (MALLOC_CHECK_LEVEL >= CHECK_CHEAP) {
+        check_block(hdr);
+      }
+      out[count++] = hdr->data;
+      if (hdr == region) {
+        // The remainder was too small to split and went with the last block
+        break;
+      }
+    }
+  }
+  return count;
+}
+
+/**
+ * @brief Helper allocate an object given a raw request size from the user
+ *
+ * @param a the arena to allocate from, locked by the caller
+ * @param raw_size number of bytes the user needs
+ * @param zeroed if not NULL, set to whether the block's data is known to be
+ * zero
+ *
+ * @return A block satisfying the user's request
+ */
+static inline header * allocate_object(arena * a, size_t raw_size, bool * zeroed) {
+  size_t newsize = request_size(raw_size);
+  if (newsize == 0) {
+	return NULL;
+  }
+
+  header * freelist = find_block(a, newsize);
+  if (freelist == NULL) {
+	freelist = grow_heap(a, newsize);
+	if (freelist == NULL) {
+		return NULL;
+	}
+  }
+
+  header * hdr = allocate_block(a, newsize, freelist, zeroed);
+  if (MALLOC_CHECK_LEVEL >= CHECK_CHEAP) {
+	check_block(hdr);
+  }
+  return hdr;
+}
+
+/**
+ * @brief Map a block size to the index of its freelist: one list per size
+ * below the small limit, SIZE_CLASS_SPLIT lists per power of two up to the
+ * large limit and the last list above it
+ *
+ * @param size the size of the block including metadata
+ *
+ * @return the index of the freelist the block belongs in
+ */
+int find_free(size_t size){
+	if (size < ((size_t) 1 << SMALL_CLASS_SHIFT)){
+		return (size - 32) / MALLOC_ALIGNMENT;
+	}
+	else if (size < ((size_t) 1 << LARGE_CLASS_SHIFT)){
+		int shift = 63 - __builtin_clzl(size);
+		int sub = (size >> (shift - __builtin_ctz(SIZE_CLASS_SPLIT))) & (SIZE_CLASS_SPLIT - 1);
+		return N_EXACT_LISTS + (shift - SMALL_CLASS_SHIFT) * SIZE_CLASS_SPLIT + sub;
+	}
+	else{
+		return N_LISTS -1;
+	}
+}
+
+/**
+ * @brief Generate the table of the smallest block size of every freelist
+ */
+static void init_size_classes() {
+  int list = 0;
+  for (size_t size = 32; size < ((size_t) 1 << SMALL_CLASS_SHIFT); size += MALLOC_ALIGNMENT) {
+    sizeClasses[list++] = size;
+  }
+  for (int shift = SMALL_CLASS_SHIFT; shift < LARGE_CLASS_SHIFT; shift++) {
+    size_t step = ((size_t) 1 << shift) / SIZE_CLASS_SPLIT;
+    for (int sub = 0; sub < SIZE_CLASS_SPLIT; sub++) {
+      sizeClasses[list++] = ((size_t) 1 << shift) + sub * step;
+    }
+  }
+  sizeClasses[list] = (size_t) 1 << LARGE_CLASS_SHIFT;
+}
+
+/**
+ * @brief Helper to get the header from a pointer allocated with malloc
+ *
+ * @param p pointer to the data region of the block
+ *
+ * @return A pointer to the header of the block
+ */
+static inline header * ptr_to_header(void * p) {
+  return (header *)((char *) p - ALLOC_HEADER_SIZE); //sizeof(header));
+}
+
+/**
+ * @brief Insert a free block at the head of a freelist
+ *
+ * @param a the arena owning the freelist
+ * @param lol the block to insert
+ * @param findfree1 the index of the freelist
+ */
+static inline void addtolist(arena * a, header * lol, int findfree1){
+	header * freelist = &a->freelistSentinels[findfree1];
+	header * next1 = get_next(freelist);
+	set_next(freelist, lol);
+	set_prev(lol, freelist);
+	set_prev(next1, lol);
+	set_next(lol, next1);
+	set_bitmap(a, findfree1);
+}
+
+/**
+ * @brief Helper to manage deallocation of a pointer returned by the user
+ *
+ * @param a the arena owning the block, locked by the caller
+ * @param p The pointer returned to the user by a call to malloc
+ */
+static inline void deallocate_object(arena * a, void * p) {
+  if (p == NULL) {
+	return;
+  }
+
+  header * lol = ptr_to_header(p);
+  if (!header_intact(lol)) {
+	report_corruption("Corrupt Header Detected");
+  }
+  if(get_object_state(lol) == UNALLOCATED){
+	printf("%s\n", "Double Free Detected");
+	assert(0);
+  }
+  set_object_state(lol, UNALLOCATED);
+  if (MALLOC_HARDENED) {
+	check_neighbours(lol);
+  }
+
+  // Memory that joins the free block and may still be resident, free
+  // neighbours that were already large had their pages released
+  char * dirtyStart = (char *) lol;
+  char * dirtyEnd = (char *) get_right_header(lol);
+
+  header * righto = get_right_header(lol);
+  if (get_object_state(righto) == UNALLOCATED) {
+	if (!pages_released(get_object_size(righto))) {
+	  dirtyEnd += get_object_size(righto);
+	} else {
+	  // Only the page of its header was kept
+	  dirtyEnd += sizeof(header);
+	}
+	remove_list(a, righto);
+	set_object_size(lol, get_object_size(lol) + get_object_size(righto));
+	get_right_header(lol) -> object_left_size = get_object_size(lol);
+  }
+
+  header * lefto = get_left_header(lol);
+  if (get_object_state(lefto) == UNALLOCATED) {
+	if (!pages_released(get_object_size(lefto))) {
+	  dirtyStart = (char *) lefto;
+	}
+	lol = combineleft(a, lol, lefto);
+  } else {
+	addtolist(a, lol, find_free(get_object_size(lol)));
+  }
+
+  if (MALLOC_CHECK_LEVEL >= CHECK_CHEAP) {
+	check_block(lol);
+  }
+  trim_after_free(a, lol, dirtyStart, dirtyEnd);
+}
+
+/**
+ * @brief Queue a block or slab object freed by a thread of another arena on
+ *        the arena that owns it, with a single compare and swap instead of
+ *        the arena's lock. The link is kept in the first word of the user's
+ *        memory.
+ *
+ * @param a the arena owning the memory
+ * @param p the user's memory
+ */
+static inline void push_remote_free(arena * a, void * p) {
+  void * head = __atomic_load_n(&a->remoteFrees, __ATOMIC_RELAXED);
+  do {
+    set_link(p, head);
+  } while (!__atomic_compare_exchange_n(&a->remoteFrees, &head, p, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Free everything other threads queued on an arena, taking the whole
+ *        queue at once. Called whenever the lock is taken to allocate, so the
+ *        queue is emptied in batches by the arena's own threads.
+ *
+ * @param a the arena, locked by the caller
+ */
+static inline void drain_remote_frees(arena * a) {
+  if (__atomic_load_n(&a->remoteFrees, __ATOMIC_RELAXED) == NULL) {
+    return;
+  }
+  void * p = __atomic_exchange_n(&a->remoteFrees, NULL, __ATOMIC_ACQUIRE);
+  while (p != NULL) {
+    void * next = get_link(p);
+    if (is_slab(p)) {
+      slab_free(a, ptr_to_slab(p), p);
+    } else {
+      deallocate_object(a, p);
+    }
+    p = next;
+  }
+}
+
+/**
+ * @brief Serve a large request from its own anonymous mapping so it never
+ * fragments the arenas and goes back to the OS as soon as it is freed
+ *
+ * @param raw_size number of bytes the user needs
+ *
+ * @return the block at the start of the mapping or NULL if the OS is out of
+ * memory
+ */
+static header * allocate_mmapped(size_t raw_size) {
+  // The header is sealed with the key, which is chosen at initialization
+  ensure_initialized();
+  size_t page = getpagesize();
+  if (raw_size > SIZE_MAX - ALLOC_HEADER_SIZE - page) {
+    return NULL;
+  }
+  size_t size = (raw_size + ALLOC_HEADER_SIZE + page - 1) & ~(page - 1);
+  void * mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    return NULL;
+  }
+
+  header * hdr = (header *) mem;
+  set_block_object_size_and_state(hdr, size, MMAPPED);
+  // Offset of the header from the start of the mapping
+  hdr->object_left_size = 0;
+  __atomic_fetch_add(&mmappedBytes, size, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&mmappedBlocks, 1, __ATOMIC_RELAXED);
+  return hdr;
+}
+
+/**
+ * @brief Return a block allocated by allocate_mmapped to the OS
+ *
+ * @param hdr the block's header
+ */
+static void deallocate_mmapped(header * hdr) {
+  if (hdr->object_size_and_state & GUARDED) {
+    guard_free(hdr);
+    return;
+  }
+  size_t size = get_object_size(hdr) + hdr->object_left_size;
+  __atomic_fetch_sub(&mmappedBytes, size, __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&mmappedBlocks, 1, __ATOMIC_RELAXED);
+  munmap((char *) hdr - hdr->object_left_size, size);
+}
+
+/**
+ * @brief Resize a block allocated by allocate_mmapped by remapping it, which
+ * lets the kernel move the pages instead of copying them
+ *
+ * @param hdr the block's header
+ * @param raw_size number of bytes the user needs
+ *
+ * @return the block's new header or NULL if it could not be remapped
+ */
+static header * remap_mmapped(header * hdr, size_t raw_size) {
+  size_t page = getpagesize();
+  // A guarded block must keep its guard page
+  if (hdr->object_left_size != 0 || (hdr->object_size_and_state & GUARDED) ||
+      raw_size > SIZE_MAX - ALLOC_HEADER_SIZE - page) {
+    return NULL;
+  }
+  size_t size = (raw_size + ALLOC_HEADER_SIZE + page - 1) & ~(page - 1);
+  size_t oldsize = get_object_size(hdr);
+  void * mem = mremap(hdr, oldsize, size, MREMAP_MAYMOVE);
+  if (mem == MAP_FAILED) {
+    return NULL;
+  }
+  __atomic_fetch_add(&mmappedBytes, size - oldsize, __ATOMIC_RELAXED);
+  hdr = (header *) mem;
+  set_object_size(hdr, size);
+  return hdr;
+}
+
+/**
+ * @brief Decide whether the guard-page debug mode serves an allocation
+ *
+ * @param raw_size number of bytes the user needs
+ *
+ * @return true if the allocation must be guarded
+ */
+static inline bool guard_sampled(size_t raw_size) {
+  size_t rate = __atomic_load_n(&guardSample, __ATOMIC_RELAXED);
+  if (rate == 0 || raw_size == 0) {
+    return false;
+  }
+  if (guardCountdown == 0) {
+    // Intervals spread around the rate, so a block allocated at a fixed
+    // period in a loop is not skipped every time
+    if (guardRng == 0) {
+      guardRng = ((uintptr_t) &guardRng * 0x9e3779b97f4a7c15ULL) | 1;
+    }
+    guardRng ^= guardRng << 13;
+    guardRng ^= guardRng >> 7;
+    guardRng ^= guardRng << 17;
+    guardCountdown = 1 + guardRng % (2 * rate - 1);
+  }
+  return --guardCountdown == 0;
+}
+
+/**
+ * @brief Serve a request from pages of its own followed by an inaccessible
+ * guard page. The data ends right at the guard page so reading or writing
+ * past it faults at once. The end is only rounded to MALLOC_ALIGNMENT to keep the
+ * data aligned, smaller overflows stay in the block.
+ *
+ * @param raw_size number of bytes the user needs
+ *
+ * @return the block or NULL if the OS is out of memory
+ */
+static header * guard_malloc(size_t raw_size) {
+  ensure_initialized();
+  size_t page = getpagesize();
+  if (raw_size > SIZE_MAX - ALLOC_HEADER_SIZE - 2 * page) {
+    return NULL;
+  }
+  size_t data = (raw_size + MALLOC_ALIGNMENT - 1) & ~(size_t) (MALLOC_ALIGNMENT - 1);
+  size_t size = (data + ALLOC_HEADER_SIZE + page - 1) & ~(page - 1);
+  char * mem = mmap(NULL, size + page, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    return NULL;
+  }
+  if (mprotect(mem + size, page, PROT_NONE) != 0) {
+    munmap(mem, size + page);
+    return NULL;
+  }
+
+  header * hdr = (header *) (mem + size - data - ALLOC_HEADER_SIZE);
+  hdr->object_size_and_state = GUARDED;
+  set_block_object_size_and_state(hdr, data + ALLOC_HEADER_SIZE, MMAPPED);
+  // Offset of the header from the start of the mapping
+  hdr->object_left_size = (char *) hdr - mem;
+  __atomic_fetch_add(&mmappedBytes, size, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&mmappedBlocks, 1, __ATOMIC_RELAXED);
+  return hdr;
+}
+
+/**
+ * @brief Quarantine a block allocated by guard_malloc: its pages become
+ * inaccessible and give their memory back, so any later access faults,
+ * including a second free. The mapping is only unmapped once GUARD_QUARANTINE
+ * more guarded blocks have been freed.
+ *
+ * @param hdr the block's header
+ */
+static void guard_free(header * hdr) {
+  size_t size = get_object_size(hdr) + hdr->object_left_size;
+  char * mem = (char *) hdr - hdr->object_left_size;
+  __atomic_fetch_sub(&mmappedBytes, size, __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&mmappedBlocks, 1, __ATOMIC_RELAXED);
+  mprotect(mem, size, PROT_NONE);
+  madvise(mem, size, MADV_DONTNEED);
+
+  pthread_mutex_lock(&guardMutex);
+  guard_mapping * slot = &guardQuarantine[guardFreed++ % GUARD_QUARANTINE];
+  guard_mapping oldest = *slot;
+  slot->mem = mem;
+  slot->size = size + getpagesize();
+  pthread_mutex_unlock(&guardMutex);
+  if (oldest.mem != NULL) {
+    munmap(oldest.mem, oldest.size);
+  }
+}
+
+/**
+ * @brief Shrink an allocated block to newsize bytes, returning the tail to
+ * the freelists when it is large enough to hold a free block
+ *
+ * @param a the arena owning the block, locked by the caller
+ * @param hdr the block to shrink
+ * @param newsize the new size of the block including metadata
+ */
+static void shrink_block(arena * a, header * hdr, size_t newsize) {
+  size_t size = get_object_size(hdr);
+  if (size - newsize < sizeof(header)) {
+    return;
+  }
+
+  // Turn the tail into an allocated block and free it so it coalesces with
+  // a free right neighbour
+  header * tail = get_header_from_offset(hdr, newsize);
+  tail->object_size_and_state = hdr->object_size_and_state & NON_MAIN_ARENA;
+  set_block_object_size_and_state(tail, size - newsize, ALLOCATED);
+  tail->object_left_size = newsize;
+  get_right_header(tail)->object_left_size = size - newsize;
+  set_object_size(hdr, newsize);
+  deallocate_object(a, tail->data);
+}
+
+/**
+ * @brief Grow an allocated block to newsize bytes in place by absorbing its
+ * free right neighbour. A block at the end of the arena's last chunk first
+ * extends the chunk when the new memory from the OS is contiguous.
+ *
+ * @param a the arena owning the block, locked by the caller
+ * @param hdr the block to grow
+ * @param newsize the new size of the block including metadata
+ *
+ * @return true if the block was grown, false if it must be moved
+ */
+static bool grow_block(arena * a, header * hdr, size_t newsize) {
+  if (MALLOC_HARDENED) {
+    check_neighbours(hdr);
+  }
+  size_t size = get_object_size(hdr);
+  header * righto = get_right_header(hdr);
+  bool rightFree = get_object_state(righto) == UNALLOCATED;
+  size_t avail = size + (rightFree ? get_object_size(righto) : 0);
+
+  if (avail < newsize) {
+    header * top = rightFree ? get_right_header(righto) : righto;
+    if (top != a->lastFencePost || grow_heap(a, newsize - avail) == NULL) {
+      return false;
+    }
+    // The new chunk merged with the free space after the block only if the
+    // OS returned memory right after the old chunk
+    righto = get_right_header(hdr);
+    rightFree = get_object_state(righto) == UNALLOCATED;
+    avail = size + (rightFree ? get_object_size(righto) : 0);
+    if (avail < newsize) {
+      return false;
+    }
+  }
+
+  take_zero_range(a, righto);
+  remove_list(a, righto);
+  set_object_size(hdr, avail);
+  get_right_header(hdr)->object_left_size = avail;
+  shrink_block(a, hdr, newsize);
+  return true;
+}
+
+/**
+ * @brief Shrink the end of an arena when the block before its last fencepost
+ * is free, keeping pad bytes of it. The main arena lowers the program break,
+ * non-main arenas give the pages of their region back with madvise.
+ *
+ * @param a the arena to trim, locked by the caller
+ * @param pad number of free bytes to keep at the end of the arena
+ *
+ * @return true if any memory was returned to the OS
+ */
+static bool trim_top(arena * a, size_t pad) {
+  if (a->lastFencePost == NULL) {
+    return false;
+  }
+  header * top = get_left_header(a->lastFencePost);
+  if (get_object_state(top) != UNALLOCATED) {
+    return false;
+  }
+  size_t size = get_object_size(top);
+  if (pad > SIZE_MAX - sizeof(header) || size <= pad + sizeof(header)) {
+    return false;
+  }
+  size_t release = (size - pad - sizeof(header)) & ~(size_t) (getpagesize() - 1);
+  if (release == 0) {
+    return false;
+  }
+
+  // Only memory at the very end of the break or region can be handed back
+  char * end = (char *) a->lastFencePost + ALLOC_HEADER_SIZE;
+  if (a == &arenas[0]) {
+    if (sbrk(0) != end || sbrk(-(intptr_t) release) == (void *) -1) {
+      return false;
+    }
+  } else {
+    heap_info * h = a->currentHeap;
+    if (h == NULL || h->top != end) {
+      return false;
+    }
+    // The top of a region sits past its heap_info rather than on a page
+    // boundary, so only the whole pages from the rounded up start go back.
+    // The page holding the top is released whole, nothing above it is in use.
+    uintptr_t page = getpagesize();
+    char * newTop = (char *) (((uintptr_t) end - release + page - 1) & ~(page - 1));
+    char * pagesEnd = (char *) (((uintptr_t) end + page - 1) & ~(page - 1));
+    if (newTop >= end || madvise(newTop, pagesEnd - newTop, MADV_DONTNEED) != 0) {
+      return false;
+    }
+    release = end - newTop;
+    h->top = newTop;
+    if (h->clean > newTop) {
+      h->clean = newTop;
+    }
+  }
+
+  remove_list(a, top);
+  set_object_size(top, size - release);
+  addtolist(a, top, find_free(size - release));
+  header * fence = get_right_header(top);
+  fence->object_size_and_state = top->object_size_and_state & NON_MAIN_ARENA;
+  initialize_fencepost(fence, size - release);
+  a->lastFencePost = fence;
+  if (a->zeroEnd > (char *) fence) {
+    a->zeroEnd = a->zeroStart < (char *) fence ? (char *) fence : a->zeroStart;
+  }
+  return true;
+}
+
+/**
+ * @brief Release the whole pages inside a free block to the OS. The pages
+ * holding the block's header and its right neighbour's header are kept.
+ *
+ * @param hdr a free block
+ * @param advice MADV_DONTNEED to drop the pages now or MADV_FREE to let the
+ * kernel reclaim them lazily
+ *
+ * @return the number of bytes released
+ */
+static size_t release_block_pages(header * hdr, int advice) {
+  uintptr_t page = getpagesize();
+  uintptr_t start = ((uintptr_t) hdr + sizeof(header) + page - 1) & ~(page - 1);
+  uintptr_t end = ((uintptr_t) hdr + get_object_size(hdr)) & ~(page - 1);
+  if (end <= start || madvise((void *) start, end - start, advice) != 0) {
+    return 0;
+  }
+  return end - start;
+}
+
+/**
+ * @brief Test whether a free block is large enough for trim_after_free to
+ * have released its pages already
+ *
+ * @param size the size of the free block
+ *
+ * @return true if the block's pages were released when it formed
+ */
+static inline bool pages_released(size_t size) {
+  size_t threshold = __atomic_load_n(&trimThreshold, __ATOMIC_RELAXED);
+  return threshold != 0 && size >= threshold;
+}
+
+/**
+ * @brief Automatic trimming after a free. A large enough free block at the
+ * end of the arena shrinks the arena, one inside the heap has the pages of
+ * the memory that just joined it released lazily. Neighbours that were
+ * already large had their pages released when they formed, so freeing the
+ * small neighbours of a large free block does not advise them again.
+ *
+ * @param a the arena owning the block, locked by the caller
+ * @param hdr the free block produced by coalescing
+ * @param start the start of the memory that joined the free block
+ * @param end the end of the memory that joined the free block
+ */
+static inline void trim_after_free(arena * a, header * hdr, char * start, char * end) {
+  if (!pages_released(get_object_size(hdr))) {
+    return;
+  }
+  if (get_right_header(hdr) == a->lastFencePost) {
+    trim_top(a, __atomic_load_n(&trimThreshold, __ATOMIC_RELAXED) / 2);
+    return;
+  }
+  // The pages holding the block's header and its right neighbour's header
+  // are kept, pages straddling the new memory are released whole
+  uintptr_t page = getpagesize();
+  uintptr_t first = ((uintptr_t) hdr + sizeof(header) + page - 1) & ~(page - 1);
+  uintptr_t last = ((uintptr_t) hdr + get_object_size(hdr)) & ~(page - 1);
+  uintptr_t from = (uintptr_t) start & ~(page - 1);
+  uintptr_t to = ((uintptr_t) end + page - 1) & ~(page - 1);
+  from = from > first ? from : first;
+  to = to < last ? to : last;
+  if (from < to) {
+    madvise((void *) from, to - from, MADV_FREE);
+  }
+}
+
+/**
+ * @brief Allocate a block whose data is aligned to alignment bytes. A block
+ * large enough for any placement is taken from the freelists, then the
+ * leading slack is split off and freed and the tail is trimmed, so the result
+ * is an ordinary block with valid boundary tags.
+ *
+ * @param a the arena to allocate from, locked by the caller
+ * @param alignment a power of two larger than the natural alignment
+ * @param raw_size number of bytes the user needs
+ *
+ * @return the aligned block or NULL if the OS is out of memory
+ */
+static header * allocate_aligned(arena * a, size_t alignment, size_t raw_size) {
+  size_t newsize = request_size(raw_size);
+  if (newsize == 0 || newsize > SIZE_MAX - alignment - 2 * sizeof(header)) {
+    return NULL;
+  }
+  // The leading slack is either empty or big enough to be a free block
+  size_t need = newsize + alignment + sizeof(header);
+  header * freelist = find_block(a, need);
+  if (freelist == NULL) {
+    freelist = grow_heap(a, need);
+    if (freelist == NULL) {
+      return NULL;
+    }
+  }
+  header * hdr = allocate_block(a, need, freelist, NULL);
+
+  uintptr_t data = (uintptr_t) hdr->data;
+  size_t slack = ((data + alignment - 1) & ~(uintptr_t) (alignment - 1)) - data;
+  while (slack != 0 && slack < sizeof(header)) {
+    slack += alignment;
+  }
+  if (slack != 0) {
+    size_t size = get_object_size(hdr);
+    header * aligned = get_header_from_offset(hdr, slack);
+    aligned->object_size_and_state = hdr->object_size_and_state & NON_MAIN_ARENA;
+    set_block_object_size_and_state(aligned, size - slack, ALLOCATED);
+    aligned->object_left_size = slack;
+    get_right_header(aligned)->object_left_size = size - slack;
+    set_object_size(hdr, slack);
+    deallocate_object(a, hdr->data);
+    hdr = aligned;
+  }
+  shrink_block(a, hdr, newsize);
+
+  if (MALLOC_CHECK_LEVEL >= CHECK_CHEAP) {
+    check_block(hdr);
+  }
+  return hdr;
+}
+
+/**
+ * @brief Serve a large aligned request from its own mapping. The header is
+ * placed just before the first aligned address in the mapping and records
+ * its offset from the start so the whole mapping is unmapped on free.
+ *
+ * @param alignment a power of two larger than the natural alignment
+ * @param raw_size number of bytes the user needs
+ *
+ * @return the aligned block or NULL if the OS is out of memory
+ */
+static header * allocate_mmapped_aligned(size_t alignment, size_t raw_size) {
+  ensure_initialized();
+  size_t page = getpagesize();
+  if (raw_size > SIZE_MAX - ALLOC_HEADER_SIZE - alignment - page) {
+    return NULL;
+  }
+  size_t size = (raw_size + ALLOC_HEADER_SIZE + alignment + page - 1) & ~(page - 1);
+  char * mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    return NULL;
+  }
+
+  uintptr_t data = ((uintptr_t) mem + ALLOC_HEADER_SIZE + alignment - 1)
+                   & ~(uintptr_t) (alignment - 1);
+  header * hdr = ptr_to_header((void *) data);
+  size_t offset = (char *) hdr - mem;
+  hdr->object_size_and_state = 0;
+  set_block_object_size_and_state(hdr, size - offset, MMAPPED);
+  hdr->object_left_size = offset;
+  __atomic_fetch_add(&mmappedBytes, size, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&mmappedBlocks, 1, __ATOMIC_RELAXED);
+  return hdr;
+}
+
+/**
+ * @brief Prepare the locks and empty freelists of an arena
+ *
+ * @param a the arena to initialize
+ */
+static void arena_init(arena * a) {
+  pthread_mutex_init(&a->mutex, NULL);
+  a->index = a - arenas;
+  a->nextChunkSize = ARENA_SIZE;
+
+  // Initialize freelist sentinels
+  for (int i = 0; i < N_LISTS; i++) {
+    header * freelist = &a->freelistSentinels[i];
+    set_next(freelist, freelist);
+    set_prev(freelist, freelist);
+  }
+  __atomic_store_n(&a->initialized, true, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Get the arena of the calling thread, assigning arenas round-robin
+ *        on a thread's first allocation
+ *
+ * @return the calling thread's arena
+ */
+static inline arena * get_arena() {
+  if (threadArena != NULL) {
+    return threadArena;
+  }
+
+  ensure_initialized();
+  unsigned i = __atomic_fetch_add(&nextArena, 1, __ATOMIC_RELAXED) % N_ARENAS;
+  arena * a = &arenas[i];
+  if (!__atomic_load_n(&a->initialized, __ATOMIC_ACQUIRE)) {
+    pthread_mutex_lock(&arenasMutex);
+    if (!a->initialized) {
+      arena_init(a);
+    }
+    pthread_mutex_unlock(&arenasMutex);
+  }
+  threadArena = a;
+  return a;
+}
+
+/**
+ * @brief Find the arena that owns a block. Blocks without the NON_MAIN_ARENA
+ *        bit belong to the main arena, the rest live in a HEAP_SIZE aligned
+ *        region that records its owner.
+ *
+ * @param hdr the block
+ *
+ * @return the owning arena
+ */
+static inline arena * block_arena(header * hdr) {
+  if (!(hdr->object_size_and_state & NON_MAIN_ARENA)) {
+    return &arenas[0];
+  }
+  heap_info * h = (heap_info *) ((uintptr_t) hdr & ~(uintptr_t) (HEAP_SIZE - 1));
+  return h->owner;
+}
+
+/**
+ * @brief Get the calling thread's cache, registering it for draining at
+ *        thread exit on first use
+ *
+ * @return the thread's cache or NULL if thread caches are disabled
+ */
+static inline tcache * get_tcache() {
+  if (TCACHE_COUNT == 0 || threadCache.disabled) {
+    return NULL;
+  }
+  if (!threadCache.registered) {
+    threadCache.registered = true;
+    pthread_setspecific(tcacheKey, &threadCache);
+    pthread_mutex_lock(&tcacheMutex);
+    threadCache.next = tcacheList.next;
+    threadCache.prev = &tcacheList;
+    tcacheList.next->prev = &threadCache;
+    tcacheList.next = &threadCache;
+    pthread_mutex_unlock(&tcacheMutex);
+  }
+  return &threadCache;
+}
+
+/**
+ * @brief Push an allocated block onto a thread cache list
+ *
+ * @param tc the thread cache
+ * @param hdr the block to cache
+ * @param list the index of the list for the block's size
+ */
+static inline void tcache_push(tcache * tc, header * hdr, int list) {
+  set_next(hdr, tc->lists[list]);
+  set_prev(hdr, (header *) tc);
+  tc->lists[list] = hdr;
+  tc->counts[list]++;
+}
+
+/**
+ * @brief Pop a block from a thread cache list
+ *
+ * @param tc the thread cache
+ * @param list the index of the list, which must be non-empty
+ *
+ * @return the cached block
+ */
+static inline header * tcache_pop(tcache * tc, int list) {
+  header * hdr = tc->lists[list];
+  if (MALLOC_HARDENED && (!header_intact(hdr) || get_object_state(hdr) != ALLOCATED)) {
+    report_corruption("Corrupt Free List Detected");
+  }
+  tc->lists[list] = get_next(hdr);
+  tc->counts[list]--;
+  return hdr;
+}
+
+/**
+ * @brief Fill a thread cache list with a batch of blocks from the freelists
+ *        under a single acquisition of the lock
+ *
+ * @param a the calling thread's arena
+ * @param tc the thread cache
+ * @param raw_size the user request the blocks must satisfy
+ */
+static void tcache_refill(arena * a, tcache * tc, size_t raw_size) {
+  pthread_mutex_lock(&a->mutex);
+  drain_remote_frees(a);
+  for (int i = 0; i < TCACHE_BATCH; i++) {
+    header * hdr = allocate_object(a, raw_size, NULL);
+    if (hdr == NULL) {
+      break;
+    }
+    int list = find_free(get_object_size(hdr));
+    if (list >= N_TCACHE_LISTS || tc->counts[list] >= TCACHE_COUNT) {
+      // The block was rounded up into a class that can not take it
+      deallocate_object(a, hdr->data);
+      continue;
+    }
+    tcache_push(tc, hdr, list);
+  }
+  if (MALLOC_CHECK_LEVEL >= CHECK_FULL) {
+    check_heap(a);
+  }
+  pthread_mutex_unlock(&a->mutex);
+}
+
+/**
+ * @brief Return up to n blocks from a thread cache list to the freelists
+ *        under a single acquisition of the lock
+ *
+ * @param a the arena owning the cached blocks
+ * @param tc the thread cache
+ * @param list the index of the list to flush
+ * @param n the maximum number of blocks to return
+ */
+static void tcache_flush(arena * a, tcache * tc, int list, unsigned n) {
+  pthread_mutex_lock(&a->mutex);
+  while (n-- > 0 && tc->counts[list] > 0) {
+    deallocate_object(a, tcache_pop(tc, list)->data);
+  }
+  if (MALLOC_CHECK_LEVEL >= CHECK_FULL) {
+    check_heap(a);
+  }
+  pthread_mutex_unlock(&a->mutex);
+}
+
+/**
+ * @brief Thread exit destructor returning every cached block to the
+ *        freelists. The cache stays disabled for any allocation made by later
+ *        destructors of the thread.
+ *
+ * @param arg the exiting thread's cache
+ */
+static void tcache_drain(void * arg) {
+  tcache * tc = (tcache *) arg;
+  tc->disabled = true;
+  pthread_mutex_lock(&tcacheMutex);
+  tc->prev->next = tc->next;
+  tc->next->prev = tc->prev;
+  pthread_mutex_unlock(&tcacheMutex);
+  for (int i = 0; i < N_TCACHE_LISTS; i++) {
+    if (tc->counts[i] > 0) {
+      tcache_flush(threadArena, tc, i, tc->counts[i]);
+    }
+  }
+  for (int i = 0; i < N_SLAB_CLASSES; i++) {
+    if (tc->slabCounts[i] > 0) {
+      slab_tcache_flush(threadArena, tc, i, tc->slabCounts[i]);
+    }
+  }
+}
+
+/**
+ * @brief Serve a small request from the calling thread's cache without
+ *        taking the lock, refilling the cache in a batch when it is empty
+ *
+ * @param a the calling thread's arena
+ * @param raw_size number of bytes the user needs
+ *
+ * @return a block satisfying the request or NULL if the request must go
+ *         through the freelists
+ */
+static inline header * tcache_get(arena * a, size_t raw_size) {
+  size_t newsize = request_size(raw_size);
+  if (newsize == 0 || find_free(newsize) >= N_TCACHE_LISTS) {
+    return NULL;
+  }
+  tcache * tc = get_tcache();
+  if (tc == NULL) {
+    return NULL;
+  }
+
+  int list = find_free(newsize);
+  if (tc->counts[list] == 0) {
+    tcache_refill(a, tc, raw_size);
+    if (tc->counts[list] == 0) {
+      return NULL;
+    }
+  }
+  return tcache_pop(tc, list);
+}
+
+/**
+ * @brief Abort if a block being freed is still in the calling thread's cache
+ *
+ * @param tc the calling thread's cache
+ * @param hdr the block being freed
+ */
+static inline void tcache_check_double_free(tcache * tc, header * hdr) {
+  // A block cached by this thread is tagged with the cache's address
+  if (get_prev(hdr) != (header *) tc) {
+    return;
+  }
+  int list = find_free(get_object_size(hdr));
+  if (list >= N_TCACHE_LISTS) {
+    return;
+  }
+  for (header * cur = tc->lists[list]; cur != NULL; cur = get_next(cur)) {
+    if (cur == hdr) {
+      printf("%s\n", "Double Free Detected");
+      assert(0);
+    }
+  }
+}
+
+/**
+ * @brief Stash a freed small block in the calling thread's cache without
+ *        taking the lock, flushing half of the list when it is full. Only
+ *        blocks of the thread's own arena are cached.
+ *
+ * @param a the arena owning the block
+ * @param hdr the block being freed
+ *
+ * @return true if the block was cached, false if it must be freed through
+ *         the freelists
+ */
+static inline bool tcache_put(arena * a, header * hdr) {
+  if (get_object_state(hdr) != ALLOCATED || a != threadArena) {
+    return false;
+  }
+  return tcache_put_list(a, hdr, find_free(get_object_size(hdr)), true);
+}
+
+/**
+ * @brief Stash a freed block of the calling thread's arena in a given list
+ *        of the thread's cache, flushing half of the list when it is full
+ *
+ * @param a the calling thread's arena, which owns the block
+ * @param hdr the block being freed
+ * @param list the index of the list to cache the block in
+ * @param check whether to abort if the block is already in the list
+ *
+ * @return true if the block was cached, false if it must be freed through
+ *         the freelists
+ */
+static inline bool tcache_put_list(arena * a, header * hdr, int list, bool check) {
+  if (list >= N_TCACHE_LISTS) {
+    return false;
+  }
+  tcache * tc = get_tcache();
+  if (tc == NULL) {
+    return false;
+  }
+
+  if (check) {
+    tcache_check_double_free(tc, hdr);
+  }
+  if (tc->counts[list] >= TCACHE_COUNT) {
+    tcache_flush(a, tc, list, TCACHE_BATCH);
+  }
+  tcache_push(tc, hdr, list);
+  return true;
+}
+
+/**
+ * @brief Test whether a pointer is an object in a slab
+ *
+ * @param p the pointer to test
+ *
+ * @return true if p lies in the slab region, never when slabs are disabled
+ */
+static inline bool is_slab(void * p) {
+  return N_SLAB_CLASSES > 0 && slabRegion != NULL &&
+    (uintptr_t) p - (uintptr_t) slabRegion < SLAB_REGION_SIZE;
+}
+
+/**
+ * @brief Find the slab holding an object
+ *
+ * @param p an object in a slab
+ *
+ * @return the slab containing p
+ */
+static inline slab * ptr_to_slab(void * p) {
+  return (slab *) ((uintptr_t) p & ~(uintptr_t) (SLAB_SIZE - 1));
+}
+
+/**
+ * @brief Remove a slab from its arena's list of slabs with free slots
+ *
+ * @param a the arena owning the slab
+ * @param s the slab to unlink
+ * @param cls the size class of the slab
+ */
+static inline void slab_unlink(arena * a, slab * s, int cls) {
+  if (s->prev != NULL) {
+    s->prev->next = s->next;
+  } else {
+    a->partialSlabs[cls] = s->next;
+  }
+  if (s->next != NULL) {
+    s->next->prev = s->prev;
+  }
+}
+
+/**
+ * @brief Insert a slab at the front of its arena's list of slabs with free
+ *        slots
+ *
+ * @param a the arena owning the slab
+ * @param s the slab to insert
+ * @param cls the size class of the slab
+ */
+static inline void slab_push(arena * a, slab * s, int cls) {
+  s->prev = NULL;
+  s->next = a->partialSlabs[cls];
+  if (s->next != NULL) {
+    s->next->prev = s;
+  }
+  a->partialSlabs[cls] = s;
+}
+
+/**
+ * @brief Set up a slab for a size class, reusing one of the arena's empty
+ *        slabs or taking the next page of the slab region
+ *
+ * @param a the arena the slab will belong to
+ * @param cls the size class of the slab
+ *
+ * @return the new slab or NULL if the slab region is used up
+ */
+static slab * new_slab(arena * a, int cls) {
+  slab * s = a->emptySlabs;
+  if (s != NULL) {
+    a->emptySlabs = s->next;
+  } else {
+    size_t off = __atomic_fetch_add(&slabRegionUsed, SLAB_SIZE, __ATOMIC_RELAXED);
+    if (off >= SLAB_REGION_SIZE) {
+      return NULL;
+    }
+    s = (slab *) (slabRegion + off);
+    a->slabBytes += SLAB_SIZE;
+  }
+
+  s->owner = a;
+  s->size = (cls + 1) * MALLOC_ALIGNMENT;
+  s->nslots = (SLAB_SIZE - SLAB_HEADER_SIZE) / s->size;
+  s->nfree = s->nslots;
+  for (unsigned w = 0; w < SLAB_BITMAP_WORDS; w++) {
+    unsigned first = w * 64;
+    if (first + 64 <= s->nslots) {
+      s->freeSlots[w] = ~(uint64_t) 0;
+    } else if (first < s->nslots) {
+      s->freeSlots[w] = ((uint64_t) 1 << (s->nslots - first)) - 1;
+    } else {
+      s->freeSlots[w] = 0;
+    }
+  }
+  slab_push(a, s, cls);
+  return s;
+}
+
+/**
+ * @brief Take the lowest free slot of the first slab of a size class,
+ *        the arena's lock must be held
+ *
+ * @param a the arena to allocate from
+ * @param cls the size class of the object
+ *
+ * @return the object or NULL if no slab could be set up
+ */
+static void * slab_alloc(arena * a, int cls) {
+  slab * s = a->partialSlabs[cls];
+  if (s == NULL) {
+    s = new_slab(a, cls);
+    if (s == NULL) {
+      return NULL;
+    }
+  }
+
+  unsigned w = 0;
+  while (s->freeSlots[w] == 0) {
+    w++;
+  }
+  unsigned bit = __builtin_ctzll(s->freeSlots[w]);
+  s->freeSlots[w] &= ~((uint64_t) 1 << bit);
+  a->slabInUseBytes += s->size;
+  if (--s->nfree == 0) {
+    slab_unlink(a, s, cls);
+  }
+  return (char *) s + SLAB_HEADER_SIZE + (size_t) (w * 64 + bit) * s->size;
+}
+
+/**
+ * @brief Return an object to its slab, the owning arena's lock must be held.
+ *        A slab that becomes empty is kept for any size class unless it is
+ *        the only slab of its class with free slots.
+ *
+ * @param a the arena owning the slab
+ * @param s the slab containing the object
+ * @param p the object being freed
+ */
+static void slab_free(arena * a, slab * s, void * p) {
+  size_t off = (char *) p - ((char *) s + SLAB_HEADER_SIZE);
+  size_t slot = off / s->size;
+  if ((char *) p < (char *) s + SLAB_HEADER_SIZE || off % s->size != 0 ||
+      slot >= s->nslots) {
+    fprintf(stderr, "%s\n", "Invalid Free Detected");
+    assert(0);
+  }
+  uint64_t mask = (uint64_t) 1 << (slot % 64);
+  if (s->freeSlots[slot / 64] & mask) {
+    printf("%s\n", "Double Free Detected");
+    assert(0);
+  }
+  s->freeSlots[slot / 64] |= mask;
+  a->slabInUseBytes -= s->size;
+
+  int cls = s->size / MALLOC_ALIGNMENT - 1;
+  if (s->nfree++ == 0) {
+    slab_push(a, s, cls);
+  }
+  if (s->nfree == s->nslots && (s->prev != NULL || s->next != NULL)) {
+    slab_unlink(a, s, cls);
+    s->next = a->emptySlabs;
+    a->emptySlabs = s;
+  }
+}
+
+/**
+ * @brief Move up to n objects from a thread cache slab list back to their
+ *        slabs under a single acquisition of the lock
+ *
+ * @param a the arena owning the cached objects
+ * @param tc the thread cache
+ * @param cls the size class to flush
+ * @param n the maximum number of objects to return
+ */
+static void slab_tcache_flush(arena * a, tcache * tc, int cls, unsigned n) {
+  pthread_mutex_lock(&a->mutex);
+  while (n-- > 0 && tc->slabCounts[cls] > 0) {
+    void * p = tc->slabLists[cls];
+    tc->slabLists[cls] = get_link(p);
+    tc->slabCounts[cls]--;
+    slab_free(a, ptr_to_slab(p), p);
+  }
+  pthread_mutex_unlock(&a->mutex);
+}
+
+/**
+ * @brief Allocate a tiny object from a slab of the calling thread's arena,
+ *        going through the thread cache when it is enabled
+ *
+ * @param raw_size number of bytes the user needs, at most SLAB_MAX_SIZE
+ *
+ * @return the object or NULL if the request must go through the freelists
+ */
+static void * slab_malloc(size_t raw_size) {
+  if (slabRegion == NULL) {
+    return NULL;
+  }
+  int cls = (raw_size - 1) / MALLOC_ALIGNMENT;
+  arena * a = get_arena();
+  tcache * tc = get_tcache();
+  if (tc == NULL) {
+    pthread_mutex_lock(&a->mutex);
+    drain_remote_frees(a);
+    void * p = slab_alloc(a, cls);
+    pthread_mutex_unlock(&a->mutex);
+    return p;
+  }
+
+  if (tc->slabCounts[cls] == 0) {
+    // Refill the cache with a batch of objects from the slabs
+    pthread_mutex_lock(&a->mutex);
+    drain_remote_frees(a);
+    for (int i = 0; i < TCACHE_BATCH; i++) {
+      void * p = slab_alloc(a, cls);
+      if (p == NULL) {
+        break;
+      }
+      set_link(p, tc->slabLists[cls]);
+      tc->slabLists[cls] = p;
+      tc->slabCounts[cls]++;
+    }
+    pthread_mutex_unlock(&a->mutex);
+    if (tc->slabCounts[cls] == 0) {
+      return NULL;
+    }
+  }
+  void * p = tc->slabLists[cls];
+  if (MALLOC_HARDENED && !is_slab(p)) {
+    report_corruption("Corrupt Free List Detected");
+  }
+  tc->slabLists[cls] = get_link(p);
+  tc->slabCounts[cls]--;
+  return p;
+}
+
+/**
+ * @brief Free a tiny object, caching it in the calling thread when the slab
+ *        belongs to the thread's arena
+ *
+ * @param p the object being freed
+ */
+static void slab_release(void * p) {
+  slab * s = ptr_to_slab(p);
+  arena * a = s->owner;
+  if (MALLOC_HARDENED && !is_arena(a)) {
+    report_corruption("Invalid Free Detected");
+  }
+  if (a != threadArena && MALLOC_CHECK_LEVEL == CHECK_OFF) {
+    push_remote_free(a, p);
+    return;
+  }
+  tcache * tc = a == threadArena ? get_tcache() : NULL;
+  if (tc == NULL) {
+    pthread_mutex_lock(&a->mutex);
+    slab_free(a, s, p);
+    pthread_mutex_unlock(&a->mutex);
+    return;
+  }
+
+  int cls = s->size / MALLOC_ALIGNMENT - 1;
+  if (MALLOC_CHECK_LEVEL >= CHECK_CHEAP) {
+    for (void * cur = tc->slabLists[cls]; cur != NULL; cur = get_link(cur)) {
+      if (cur == p) {
+        printf("%s\n", "Double Free Detected");
+        assert(0);
+      }
+    }
+  }
+  if (tc->slabCounts[cls] >= TCACHE_COUNT) {
+    slab_tcache_flush(a, tc, cls, TCACHE_BATCH);
+  }
+  set_link(p, tc->slabLists[cls]);
+  tc->slabLists[cls] = p;
+  tc->slabCounts[cls]++;
+}
+
+/**
+ * @brief Register the calling thread's counters so my_malloc_stats sees
+ *        them, or count into the exited threads' totals once the thread has
+ *        retired its counters
+ *
+ * @param offset offset of the counter in thread_stats
+ * @param n the number of operations
+ */
+static void count_op_slow(size_t offset, size_t n) {
+  if (threadStats.retired) {
+    __atomic_fetch_add((size_t *) ((char *) &statsList + offset), n,
+                       __ATOMIC_RELAXED);
+    return;
+  }
+  ensure_initialized();
+  pthread_mutex_lock(&statsMutex);
+  threadStats.next = statsList.next;
+  threadStats.prev = &statsList;
+  statsList.next->prev = &threadStats;
+  statsList.next = &threadStats;
+  pthread_mutex_unlock(&statsMutex);
+  pthread_setspecific(statsKey, &threadStats);
+  threadStats.active = true;
+  count_op(offset, n);
+}
+
+/**
+ * @brief Count operations in the calling thread's counters
+ *
+ * @param offset offset of the counter in thread_stats
+ * @param n the number of operations
+ */
+static inline void count_op(size_t offset, size_t n) {
+  if (!threadStats.active) {
+    count_op_slow(offset, n);
+    return;
+  }
+  // Only this thread writes the counter, my_malloc_stats may read it
+  size_t * counter = (size_t *) ((char *) &threadStats + offset);
+  __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Thread exit destructor folding a thread's counters into the totals
+ *        of the exited threads. Operations of later destructors of the
+ *        thread are counted there directly.
+ *
+ * @param arg the exiting thread's counters
+ */
+static void stats_retire(void * arg) {
+  thread_stats * ts = (thread_stats *) arg;
+  pthread_mutex_lock(&statsMutex);
+  ts->prev->next = ts->next;
+  ts->next->prev = ts->prev;
+  __atomic_fetch_add(&statsList.mallocs, ts->mallocs, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&statsList.frees, ts->frees, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&statsList.reallocs, ts->reallocs, __ATOMIC_RELAXED);
+  ts->active = false;
+  ts->retired = true;
+  pthread_mutex_unlock(&statsMutex);
+}
+
+/**
+ * @brief Nanoseconds on the monotonic clock
+ */
+static inline uint64_t trace_clock() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Append the records of a thread's buffer to the trace file and empty
+ *        the buffer. Records are dropped if the trace was stopped.
+ *
+ * @param tb the buffer to write out
+ */
+static void trace_flush(trace_buffer * tb) {
+  pthread_mutex_lock(&traceMutex);
+  if (traceFd >= 0) {
+    char * data = (char *) tb->records;
+    size_t left = tb->count * sizeof(trace_record);
+    while (left > 0) {
+      ssize_t written = write(traceFd, data, left);
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      if (written <= 0) {
+        break;
+      }
+      data += written;
+      left -= written;
+    }
+  }
+  pthread_mutex_unlock(&traceMutex);
+  tb->count = 0;
+}
+
+/**
+ * @brief Record a call in the calling thread's trace buffer, mapping the
+ *        buffer on the thread's first recorded call
+ *
+ * @param op the call
+ * @param ptr the block returned or freed
+ * @param arg the block a realloc resized or the alignment of a memalign
+ * @param size the bytes requested
+ */
+static void trace_op_slow(enum trace_op op, void * ptr, uint64_t arg, size_t size) {
+  trace_buffer * tb = traceBuffer;
+  if (tb == NULL) {
+    tb = mmap(NULL, sizeof(trace_buffer), PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (tb == MAP_FAILED) {
+      return;
+    }
+    tb->thread = __atomic_add_fetch(&traceThreads, 1, __ATOMIC_RELAXED);
+    tb->count = 0;
+    traceBuffer = tb;
+    ensure_initialized();
+    pthread_setspecific(traceKey, tb);
+  }
+
+  trace_record * r = &tb->records[tb->count++];
+  r->seq = __atomic_fetch_add(&traceSeq, 1, __ATOMIC_RELAXED);
+  r->time = trace_clock() - traceStart;
+  r->ptr = (uintptr_t) ptr;
+  r->arg = arg;
+  r->size = size;
+  r->thread = tb->thread;
+  r->op = op;
+  if (tb->count == TRACE_BUFFER_RECORDS) {
+    trace_flush(tb);
+  }
+}
+
+/**
+ * @brief Record a call if a trace is being recorded. Allocations must be
+ *        recorded after the block is allocated and frees before it is freed,
+ *        so a block handed from one thread to another is always freed before
+ *        it is allocated again in the order of the records.
+ *
+ * @param op the call
+ * @param ptr the block returned or freed
+ * @param arg the block a realloc resized or the alignment of a memalign
+ * @param size the bytes requested
+ */
+static inline void trace_op(enum trace_op op, void * ptr, uint64_t arg, size_t size) {
+  if (MALLOC_TRACE && __atomic_load_n(&traceFd, __ATOMIC_RELAXED) >= 0) {
+    trace_op_slow(op, ptr, arg, size);
+  }
+}
+
+/**
+ * @brief Thread exit destructor writing out a thread's trace records. Calls
+ *        made by later destructors of the thread map a new buffer, which is
+ *        written out by the next round of destructors.
+ *
+ * @param arg the exiting thread's trace buffer
+ */
+static void trace_retire(void * arg) {
+  trace_buffer * tb = (trace_buffer *) arg;
+  trace_flush(tb);
+  traceBuffer = NULL;
+  munmap(tb, sizeof(trace_buffer));
+}
+
+/**
+ * @brief Destructor writing out the trace records of the thread that exits
+ *        the program
+ */
+static void trace_exit() {
+  if (traceBuffer != NULL) {
+    trace_flush(traceBuffer);
+  }
+}
+
+bool my_malloc_trace_start(const char * path) {
+  if (!MALLOC_TRACE) {
+    return false;
+  }
+  ensure_initialized();
+  pthread_mutex_lock(&traceMutex);
+  if (traceFd >= 0) {
+    pthread_mutex_unlock(&traceMutex);
+    return false;
+  }
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    pthread_mutex_unlock(&traceMutex);
+    return false;
+  }
+  trace_file_header fh = { .version = TRACE_VERSION,
+                           .record_size = sizeof(trace_record) };
+  memcpy(fh.magic, TRACE_MAGIC, sizeof(fh.magic));
+  if (write(fd, &fh, sizeof(fh)) != sizeof(fh)) {
+    close(fd);
+    pthread_mutex_unlock(&traceMutex);
+    return false;
+  }
+  traceStart = trace_clock();
+  __atomic_store_n(&traceFd, fd, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&traceMutex);
+  return true;
+}
+
+void my_malloc_trace_stop() {
+  if (traceBuffer != NULL) {
+    trace_flush(traceBuffer);
+  }
+  pthread_mutex_lock(&traceMutex);
+  if (traceFd >= 0) {
+    close(traceFd);
+    __atomic_store_n(&traceFd, -1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&traceMutex);
+}
+
+/**
+ * @brief Bucket of the free filter and home slot in the sample table of an
+ *        address
+ *
+ * @param ptr the address of a sampled block
+ *
+ * @return a well mixed hash of the address
+ */
+static inline size_t profile_hash(uintptr_t ptr) {
+  return (ptr * 0x9e3779b97f4a7c15ULL) >> 16;
+}
+
+/**
+ * @brief Draw the number of bytes to allocate before the next sample from
+ *        an exponential distribution, so every byte allocated is equally
+ *        likely to be sampled. The logarithm is approximated from the
+ *        exponent and a polynomial of the mantissa, which is plenty for
+ *        sampling and needs no math library.
+ *
+ * @param rate mean number of bytes between two samples
+ *
+ * @return the bytes until the next sample, at least 1
+ */
+static size_t profile_interval(size_t rate) {
+  if (profileRng == 0) {
+    profileRng = ((uintptr_t) &profileRng ^ trace_clock()) * 0x9e3779b97f4a7c15ULL | 1;
+  }
+  profileRng ^= profileRng << 13;
+  profileRng ^= profileRng >> 7;
+  profileRng ^= profileRng << 17;
+
+  // u = x / 2^53 = m * 2^(e - 53) with m in [1, 2) is uniform over (0, 1],
+  // so -ln(u) = (53 - e) * ln(2) - ln(m)
+  uint64_t x = (profileRng >> 11) + 1;
+  int e = 63 - __builtin_clzll(x);
+  double m = (double) x / (double) ((uint64_t) 1 << e);
+  double lnm = -1.7417939 + (2.8212026 + (-1.4699568 + (0.44717955
+               - 0.056570851 * m) * m) * m) * m;
+  double draw = (53 - e) * 0.6931471805599453 - lnm;
+  return (size_t) (draw > 0 ? draw * rate : 0) + 1;
+}
+
+/**
+ * @brief Insert a sample into the table, doubling the table when it is half
+ *        full. Called with profileMutex held.
+ *
+ * @param sample the sample to insert
+ *
+ * @return false if the table could not grow
+ */
+static bool profile_insert(profile_sample * sample) {
+  size_t live = __atomic_load_n(&profileLive, __ATOMIC_RELAXED);
+  if (2 * (live + 1) > profileCapacity) {
+    size_t capacity = profileCapacity ? 2 * profileCapacity : 1024;
+    profile_sample * table = mmap(NULL, capacity * sizeof(profile_sample),
+                                  PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) {
+      return false;
+    }
+    profile_sample * old = profileTable;
+    size_t oldCapacity = profileCapacity;
+    profileTable = table;
+    profileCapacity = capacity;
+    for (size_t i = 0; i < oldCapacity; i++) {
+      if (old[i].ptr != 0) {
+        size_t j = profile_hash(old[i].ptr) & (capacity - 1);
+        while (table[j].ptr != 0) {
+          j = (j + 1) & (capacity - 1);
+        }
+        table[j] = old[i];
+      }
+    }
+    if (old != NULL) {
+      munmap(old, oldCapacity * sizeof(profile_sample));
+    }
+  }
+
+  size_t mask = profileCapacity - 1;
+  size_t i = profile_hash(sample->ptr) & mask;
+  while (profileTable[i].ptr != 0) {
+    i = (i + 1) & mask;
+  }
+  profileTable[i] = *sample;
+  return true;
+}
+
+/**
+ * @brief Remove the sample of a block from the table if there is one,
+ *        shifting the following samples of its cluster back over the hole.
+ *        Called with profileMutex held.
+ *
+ * @param ptr the block
+ *
+ * @return true if the block had been sampled
+ */
+static bool profile_remove(uintptr_t ptr) {
+  if (profileTable == NULL) {
+    return false;
+  }
+  size_t mask = profileCapacity - 1;
+  size_t i = profile_hash(ptr) & mask;
+  while (profileTable[i].ptr != ptr) {
+    if (profileTable[i].ptr == 0) {
+      return false;
+    }
+    i = (i + 1) & mask;
+  }
+  size_t hole = i;
+  for (size_t j = (i + 1) & mask; profileTable[j].ptr != 0; j = (j + 1) & mask) {
+    size_t home = profile_hash(profileTable[j].ptr) & mask;
+    if (((j - home) & mask) >= ((j - hole) & mask)) {
+      profileTable[hole] = profileTable[j];
+      hole = j;
+    }
+  }
+  profileTable[hole].ptr = 0;
+  return true;
+}
+
+/**
+ * @brief Take a sample once a thread's countdown runs out: record the stack
+ *        of the allocation and draw the next countdown. Allocations made by
+ *        the profiler itself, such as when backtrace loads the unwinder, are
+ *        never sampled.
+ *
+ * @param ptr the block allocated
+ * @param size the bytes requested
+ */
+static void profile_malloc_slow(void * ptr, size_t size) {
+  size_t rate = __atomic_load_n(&profileRate, __ATOMIC_RELAXED);
+  if (rate == 0 || profileBusy) {
+    return;
+  }
+  bool first = profileRng == 0;
+  profileCountdown = profile_interval(rate);
+  if (first) {
+    // A thread's first countdown starts at its first allocation
+    profileCountdown -= size;
+    if (profileCountdown > 0) {
+      return;
+    }
+  }
+
+  profileBusy = true;
+  profile_sample sample;
+  void * frames[PROFILE_MAX_FRAMES + 1];
+  // Drop the frame of this function
+  int depth = backtrace(frames, PROFILE_MAX_FRAMES + 1) - 1;
+  sample.ptr = (uintptr_t) ptr;
+  sample.size = size;
+  sample.depth = depth > 0 ? depth : 0;
+  memcpy(sample.frames, frames + 1, sample.depth * sizeof(void *));
+
+  pthread_mutex_lock(&profileMutex);
+  if (profile_insert(&sample)) {
+    __atomic_fetch_add(&profileFilter[profile_hash(sample.ptr) % PROFILE_FILTER_SIZE],
+                       1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&profileLive, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&profileMutex);
+
+  if (__atomic_load_n(&profileRequested, __ATOMIC_RELAXED) &&
+      __atomic_exchange_n(&profileRequested, false, __ATOMIC_ACQUIRE)) {
+    char name[sizeof(profilePath) + 64];
+    unsigned n = __atomic_fetch_add(&profileDumps, 1, __ATOMIC_RELAXED);
+    snprintf(name, sizeof(name), "%s.%d.%u.heap", profilePath, (int) getpid(), n);
+    my_malloc_profile_dump(name);
+  }
+  profileBusy = false;
+}
+
+/**
+ * @brief Count an allocation towards the calling thread's next sample. Must
+ *        be called after the block is allocated, like trace_op.
+ *
+ * @param ptr the block allocated
+ * @param size the bytes requested
+ */
+static inline void profile_malloc(void * ptr, size_t size) {
+  if (__atomic_load_n(&profileRate, __ATOMIC_RELAXED) == 0) {
+    return;
+  }
+  profileCountdown -= size;
+  if (profileCountdown <= 0) {
+    profile_malloc_slow(ptr, size);
+  }
+}
+
+/**
+ * @brief Drop the sample of a block being freed
+ *
+ * @param ptr the block
+ */
+static void profile_free_slow(void * ptr) {
+  pthread_mutex_lock(&profileMutex);
+  if (profile_remove((uintptr_t) ptr)) {
+    __atomic_fetch_sub(&profileFilter[profile_hash((uintptr_t) ptr) % PROFILE_FILTER_SIZE],
+                       1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&profileLive, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&profileMutex);
+}
+
+/**
+ * @brief Drop the sample of a block being freed, if it might have one. Must
+ *        be called before the block is freed, like trace_op, so the address
+ *        is not sampled again by another thread first.
+ *
+ * @param ptr the block
+ */
+static inline void profile_free(void * ptr) {
+  if (__atomic_load_n(&profileLive, __ATOMIC_RELAXED) != 0 &&
+      __atomic_load_n(&profileFilter[profile_hash((uintptr_t) ptr) % PROFILE_FILTER_SIZE],
+                      __ATOMIC_RELAXED) != 0) {
+    profile_free_slow(ptr);
+  }
+}
+
+/**
+ * @brief Signal handler requesting a profile. Writing it here could deadlock
+ *        on the profiler's lock, so the next sample writes it.
+ *
+ * @param sig the signal
+ */
+static void profile_signal(int sig) {
+  (void) sig;
+  __atomic_store_n(&profileRequested, true, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Write a whole buffer to a file, retrying short writes
+ *
+ * @param fd the file
+ * @param data the bytes to write
+ * @param size the number of bytes
+ *
+ * @return true if everything was written
+ */
+static bool write_all(int fd, const char * data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+bool my_malloc_profile_dump(const char * path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  // Nothing the dump allocates is sampled
+  bool busy = profileBusy;
+  profileBusy = true;
+
+  // Copy the samples so the lock is not held while writing
+  pthread_mutex_lock(&profileMutex);
+  size_t count = __atomic_load_n(&profileLive, __ATOMIC_RELAXED);
+  size_t bytes = count * sizeof(profile_sample);
+  profile_sample * samples = NULL;
+  if (count > 0) {
+    samples = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (samples == MAP_FAILED) {
+      pthread_mutex_unlock(&profileMutex);
+      close(fd);
+      profileBusy = busy;
+      return false;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < profileCapacity; i++) {
+      if (profileTable[i].ptr != 0) {
+        samples[n++] = profileTable[i];
+      }
+    }
+  }
+  pthread_mutex_unlock(&profileMutex);
+
+  size_t total = 0;
+  for (size_t i = 0; i < count; i++) {
+    total += samples[i].size;
+  }
+  char line[64 + 20 * PROFILE_MAX_FRAMES];
+  int len = snprintf(line, sizeof(line), "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                     count, total, count, total,
+                     __atomic_load_n(&profileRate, __ATOMIC_RELAXED));
+  bool ok = write_all(fd, line, len);
+  for (size_t i = 0; ok && i < count; i++) {
+    len = snprintf(line, sizeof(line), "1: %zu [1: %zu] @", samples[i].size,
+                   samples[i].size);
+    for (size_t f = 0; f < samples[i].depth; f++) {
+      len += snprintf(line + len, sizeof(line) - len, " %p", samples[i].frames[f]);
+    }
+    line[len++] = '\n';
+    ok = write_all(fd, line, len);
+  }
+
+  // pprof maps the addresses to the binaries loaded at the time
+  int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  if (ok && maps >= 0) {
+    ok = write_all(fd, "\nMAPPED_LIBRARIES:\n", 19);
+    ssize_t got;
+    while (ok && (got = read(maps, line, sizeof(line))) > 0) {
+      ok = write_all(fd, line, got);
+    }
+  }
+  if (maps >= 0) {
+    close(maps);
+  }
+  if (samples != NULL) {
+    munmap(samples, bytes);
+  }
+  ok = close(fd) == 0 && ok;
+  profileBusy = busy;
+  return ok;
+}
+
+/**
+ * @brief Add the memory of one arena to a snapshot, the arena's lock must be
+ *        held
+ *
+ * @param a the arena to walk
+ * @param stats the snapshot to add to
+ */
+static void arena_stats(arena * a, malloc_stats * stats) {
+  for (size_t i = 0; i < a->numOsChunks; i++) {
+    // Each chunk is bounded by a fencepost on either side
+    header * cur = get_right_header(a->osChunkList[i]);
+    stats->os_bytes += 2 * ALLOC_HEADER_SIZE;
+    for (; get_object_state(cur) != FENCEPOST; cur = get_right_header(cur)) {
+      size_t size = get_object_size(cur);
+      stats->os_bytes += size;
+      if (get_object_state(cur) == UNALLOCATED) {
+        stats->free_bytes += size;
+        stats->free_bytes_per_list[find_free(size)] += size;
+        if (size > stats->largest_free) {
+          stats->largest_free = size;
+        }
+      } else {
+        stats->in_use_bytes += size;
+      }
+    }
+  }
+  stats->chunks += a->numOsChunks;
+  stats->os_bytes += a->slabBytes;
+  stats->in_use_bytes += a->slabInUseBytes;
+}
+
+/**
+ * @brief Helper to detect cycles in the free list
+ * https://en.wikipedia.org/wiki/Cycle_detection#Floyd's_Tortoise_and_Hare
+ *
+ * @param a the arena to check
+ *
+ * @return One of the nodes in the cycle or NULL if no cycle is present
+ */
+static inline header * detect_cycles(arena * a) {
+  for (int i = 0; i < N_LISTS; i++) {
+    header * freelist = &a->freelistSentinels[i];
+    for (header * slow = get_next(freelist), * fast = get_next(get_next(freelist));
+         fast != freelist; 
+         slow = get_next(slow), fast = get_next(get_next(fast))) {
+      if (slow == fast) {
+        return slow;
+      }
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Helper to verify that there are no unlinked previous or next pointers
+ *        in the free list and that every block is in the list for its size
+ *
+ * @param a the arena to check
+ *
+ * @return A node whose previous and next pointers or list are incorrect or
+ *         NULL if no such node exists
+ */
+static inline header * verify_pointers(arena * a) {
+  for (int i = 0; i < N_LISTS; i++) {
+    header * freelist = &a->freelistSentinels[i];
+    for (header * cur = get_next(freelist); cur != freelist; cur = get_next(cur)) {
+      if (get_prev(get_next(cur)) != cur || get_next(get_prev(cur)) != cur ||
+          find_free(get_object_size(cur)) != i) {
+        return cur;
+      }
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Verify the structure of the free list is correct by checkin for 
+ *        cycles and misdirected pointers
+ *
+ * @param a the arena to check
+ *
+ * @return true if the list is valid
+ */
+static inline bool verify_freelist(arena * a) {
+  header * cycle = detect_cycles(a);
+  if (cycle != NULL) {
+    fprintf(stderr, "Cycle Detected\n");
+    print_sublist(print_object, get_next(cycle), cycle);
+    return false;
+  }
+
+  header * invalid = verify_pointers(a);
+  if (invalid != NULL) {
+    fprintf(stderr, "Invalid pointers\n");
+    print_object(invalid);
+    return false;
+  }
+
+  for (int i = 0; i < N_LISTS; i++) {
+    header * freelist = &a->freelistSentinels[i];
+    bool set = (a->freelist_bitmap[i >> 3] >> (i & 7)) & 1;
+    if (set != (get_next(freelist) != freelist)) {
+      fprintf(stderr, "Invalid bitmap\n");
+      print_bitmap();
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * @brief Helper to verify that the sizes in a chunk from the OS are correct
+ *        and, in hardened builds, that every header's checksum is intact
+ *
+ * @param chunk AREA_SIZE chunk allocated from the OS
+ *
+ * @return a pointer to an invalid header or NULL if all header's are valid
+ */
+static inline header * verify_chunk(header * chunk) {
+	if (get_object_state(chunk) != FENCEPOST) {
+		fprintf(stderr, "Invalid fencepost\n");
+		print_object(chunk);
+		return chunk;
 	}
-	
-	for (; get_object_state(chunk) != FENCEPOST; chunk = get_right_header(chunk)) {
+
+	for (chunk = get_right_header(chunk); get_object_state(chunk) != FENCEPOST; chunk = get_right_header(chunk)) {
+		if (!header_intact(chunk)) {
+			fprintf(stderr, "Invalid checksum\n");
+			print_object(chunk);
+			return chunk;
+		}
 		if (get_object_size(chunk)  != get_right_header(chunk)->object_left_size) {
 			fprintf(stderr, "Invalid sizes\n");
 			print_object(chunk);
 			return chunk;
 		}
 	}
-	
+
 	return NULL;
 }
 
 /**
- * @brief For each chunk allocated by the OS verify that the boundary tags
- *        are consistent
+ * @brief For each chunk allocated by the OS verify that the boundary tags
+ *        are consistent
+ *
+ * @param a the arena to check
+ *
+ * @return true if the boundary tags are valid
+ */
+static inline bool verify_tags(arena * a) {
+  for (size_t i = 0; i < a->numOsChunks; i++) {
+    header * invalid = verify_chunk(a->osChunkList[i]);
+    if (invalid != NULL) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * @brief Verify that every slab with free slots belongs to the arena and
+ *        that its free count matches its bitmap
+ *
+ * @param a the arena to check
+ *
+ * @return true if the slabs are valid
+ */
+static inline bool verify_slabs(arena * a) {
+  for (int cls = 0; cls < N_SLAB_CLASSES; cls++) {
+    for (slab * s = a->partialSlabs[cls]; s != NULL; s = s->next) {
+      unsigned nfree = 0;
+      for (unsigned w = 0; w < SLAB_BITMAP_WORDS; w++) {
+        nfree += __builtin_popcountll(s->freeSlots[w]);
+      }
+      if (s->owner != a || s->size != (unsigned) (cls + 1) * MALLOC_ALIGNMENT ||
+          s->nfree == 0 || nfree != s->nfree) {
+        fprintf(stderr, "Invalid slab at %p\n", (void *) s);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Verify the freelists, boundary tags and slabs of a single arena
+ *
+ * @param a the arena to check
+ *
+ * @return true if the arena is valid
+ */
+static inline bool verify_arena(arena * a) {
+  return verify_freelist(a) && verify_tags(a) && verify_slabs(a);
+}
+
+/**
+ * @brief Cheap constant time check of a single block: its boundary tags must
+ *        agree with both neighbours and, if free, its freelist neighbours must
+ *        point back at it
+ *
+ * @param hdr the block to check
+ */
+static inline void check_block(header * hdr) {
+  bool valid = get_right_header(hdr)->object_left_size == get_object_size(hdr)
+    && get_object_size(get_left_header(hdr)) == hdr->object_left_size;
+  if (valid && get_object_state(hdr) == UNALLOCATED) {
+    valid = get_prev(get_next(hdr)) == hdr && get_next(get_prev(hdr)) == hdr;
+  }
+  if (!valid) {
+    fprintf(stderr, "Corrupt block\n");
+    print_object(hdr);
+    assert(0);
+  }
+}
+
+/**
+ * @brief Walk every freelist and chunk of an arena, aborting if any structure
+ *        is invalid. Only used when MALLOC_CHECK_LEVEL is CHECK_FULL.
+ *
+ * @param a the arena to check, locked by the caller
+ */
+static inline void check_heap(arena * a) {
+  if (!verify_arena(a)) {
+    assert(0);
+  }
+}
+
+/**
+ * @brief Report heap corruption found by a check and abort. Hardened builds
+ *        must stop even when assertions are compiled out.
  *
- * @return true if the boundary tags are valid
+ * @param msg what was found
  */
-static inline bool verify_tags() {
-  for (size_t i = 0; i < numOsChunks; i++) {
-    header * invalid = verify_chunk(osChunkList[i]);
-    if (invalid != NULL) {
-      return invalid;
+static void report_corruption(const char * msg) {
+  fprintf(stderr, "%s\n", msg);
+  assert(0);
+  abort();
+}
+
+/**
+ * @brief Test whether a pointer read from the heap is one of the initialized
+ *        arenas
+ *
+ * @param a the pointer to test
+ *
+ * @return true if a is an arena in use
+ */
+static inline bool is_arena(arena * a) {
+  uintptr_t off = (uintptr_t) a - (uintptr_t) arenas;
+  return off < sizeof(arena) * N_ARENAS && off % sizeof(arena) == 0 &&
+    __atomic_load_n(&a->initialized, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Test whether a block lies inside one of the chunks an arena got from
+ *        the OS, going by the arena's list of chunks rather than anything
+ *        stored in the heap. Called without the lock: the lists are published
+ *        before the count, old lists stay mapped and the chunks of an arena
+ *        only grow while a block in them is allocated.
+ *
+ * @param a the arena the block claims to belong to
+ * @param hdr the block
+ *
+ * @return true if the whole block is inside a chunk
+ */
+static bool in_os_chunk(arena * a, header * hdr) {
+  size_t n = __atomic_load_n(&a->numOsChunks, __ATOMIC_ACQUIRE);
+  header ** starts = __atomic_load_n(&a->osChunkList, __ATOMIC_ACQUIRE);
+  header ** ends = __atomic_load_n(&a->osChunkEnds, __ATOMIC_ACQUIRE);
+  char * start = (char *) hdr;
+  char * end = start + get_object_size(hdr);
+  // Most blocks are freed from the most recent chunk
+  for (size_t i = n; i-- > 0; ) {
+    char * chunkEnd = i == n - 1 ? (char *) __atomic_load_n(&a->lastFencePost, __ATOMIC_RELAXED)
+                                 : (char *) ends[i];
+    if (start > (char *) starts[i] && end > start && end <= chunkEnd) {
+      return true;
     }
   }
+  return false;
+}
 
-  return NULL;
+/**
+ * @brief Hardened builds only: abort unless a block being freed or resized
+ *        has an intact header, is allocated, and lies in a chunk of its arena
+ *        or at the start of a mapping of its own
+ *
+ * @param hdr the block's header
+ */
+static void check_free(header * hdr) {
+  if (!header_intact(hdr)) {
+    report_corruption("Corrupt Header Detected");
+  }
+  switch (get_object_state(hdr)) {
+    case ALLOCATED: {
+      arena * a = block_arena(hdr);
+      if (is_arena(a) && in_os_chunk(a, hdr)) {
+        return;
+      }
+      break;
+    }
+    case MMAPPED: {
+      size_t page = getpagesize();
+      if (((uintptr_t) hdr - hdr->object_left_size) % page == 0 &&
+          (get_object_size(hdr) + hdr->object_left_size) % page == 0) {
+        return;
+      }
+      break;
+    }
+    case UNALLOCATED:
+      report_corruption("Double Free Detected");
+      break;
+    default:
+      break;
+  }
+  report_corruption("Invalid Free Detected");
 }
 
 /**
- * @brief Initialize mutex lock and prepare an initial chunk of memory for allocation
+ * @brief Hardened builds only: abort unless the headers of both neighbours of
+ *        a block are intact and their boundary tags agree with the block's,
+ *        so a corrupted neighbour is never coalesced with
+ *
+ * @param hdr the block about to be merged with its neighbours
+ */
+static inline void check_neighbours(header * hdr) {
+  header * right = get_right_header(hdr);
+  header * left = get_left_header(hdr);
+  if (!header_intact(right) || right->object_left_size != get_object_size(hdr) ||
+      !header_intact(left) || get_right_header(left) != hdr) {
+    report_corruption("Corrupt Header Detected");
+  }
+}
+
+/**
+ * @brief Read the link kept in the first word of a free slab object or a
+ *        block queued on an arena
+ *
+ * @param p the free memory
+ *
+ * @return the next object of the list
+ */
+static inline void * get_link(void * p) {
+  return protect_pointer(p, *(void **) p);
+}
+
+/**
+ * @brief Store the link kept in the first word of free memory
+ *
+ * @param p the free memory
+ * @param next the next object of the list
+ */
+static inline void set_link(void * p, void * next) {
+  *(void **) p = protect_pointer(p, next);
+}
+
+/**
+ * @brief Choose the key of the hardened checks, from the kernel's random
+ *        pool when it is available
+ */
+static void init_hardened_key() {
+  uintptr_t key;
+  if (getrandom(&key, sizeof(key), GRND_NONBLOCK) != sizeof(key)) {
+    key = (uintptr_t) &key ^ trace_clock() * 0x9e3779b97f4a7c15;
+  }
+  hardenedKey = key;
+}
+
+/**
+ * @brief Take every lock of the allocator before fork, so the child never
+ *        inherits a lock held by a thread that does not exist in it. Any new
+ *        lock must be taken here and released by fork_parent.
+ */
+static void fork_prepare() {
+  // Holding arenasMutex keeps the set of initialized arenas fixed
+  pthread_mutex_lock(&arenasMutex);
+  for (int i = 0; i < N_ARENAS; i++) {
+    if (arenas[i].initialized) {
+      pthread_mutex_lock(&arenas[i].mutex);
+    }
+  }
+  pthread_mutex_lock(&tcacheMutex);
+  pthread_mutex_lock(&statsMutex);
+  pthread_mutex_lock(&traceMutex);
+  pthread_mutex_lock(&guardMutex);
+  pthread_mutex_lock(&profileMutex);
+}
+
+/**
+ * @brief Release the locks taken by fork_prepare in the parent
+ */
+static void fork_parent() {
+  pthread_mutex_unlock(&profileMutex);
+  pthread_mutex_unlock(&guardMutex);
+  pthread_mutex_unlock(&traceMutex);
+  pthread_mutex_unlock(&statsMutex);
+  pthread_mutex_unlock(&tcacheMutex);
+  for (int i = N_ARENAS - 1; i >= 0; i--) {
+    if (arenas[i].initialized) {
+      pthread_mutex_unlock(&arenas[i].mutex);
+    }
+  }
+  pthread_mutex_unlock(&arenasMutex);
+}
+
+/**
+ * @brief Release the locks taken by fork_prepare in the child, whose only
+ *        thread is the one that forked and holds them
+ */
+static void fork_child() {
+  // The parent keeps recording the trace, the child's records would be
+  // mixed into it. Records the parent buffered are written by the parent.
+  if (traceFd >= 0) {
+    close(traceFd);
+    traceFd = -1;
+  }
+  if (traceBuffer != NULL) {
+    traceBuffer->count = 0;
+  }
+  fork_reclaim_threads();
+  fork_parent();
+}
+
+/**
+ * @brief Clear the state the other threads of the parent left behind in a
+ *        forked child: their cached blocks go back to the arenas and their
+ *        operation counts into the exited threads' totals. Their thread
+ *        local memory is still mapped in the child, so it can be read. A
+ *        thread stopped in the middle of a cache operation leaves the block
+ *        it was moving out of the lists, which only leaks that block.
+ *
+ *        Called in the child while the locks of fork_prepare are held.
+ */
+static void fork_reclaim_threads() {
+  for (tcache * tc = tcacheList.next; tc != &tcacheList; ) {
+    tcache * next = tc->next;
+    if (tc != &threadCache) {
+      for (int i = 0; i < N_TCACHE_LISTS; i++) {
+        for (header * hdr = tc->lists[i]; hdr != NULL; ) {
+          header * following = get_next(hdr);
+          deallocate_object(block_arena(hdr), hdr->data);
+          hdr = following;
+        }
+      }
+      for (int i = 0; i < N_SLAB_CLASSES; i++) {
+        for (void * p = tc->slabLists[i]; p != NULL; ) {
+          void * following = get_link(p);
+          slab * s = ptr_to_slab(p);
+          slab_free(s->owner, s, p);
+          p = following;
+        }
+      }
+      tc->prev->next = tc->next;
+      tc->next->prev = tc->prev;
+    }
+    tc = next;
+  }
+
+  for (thread_stats * ts = statsList.next; ts != &statsList; ) {
+    thread_stats * next = ts->next;
+    if (ts != &threadStats) {
+      statsList.mallocs += ts->mallocs;
+      statsList.frees += ts->frees;
+      statsList.reallocs += ts->reallocs;
+      ts->prev->next = ts->next;
+      ts->next->prev = ts->prev;
+    }
+    ts = next;
+  }
+}
+
+/**
+ * @brief Constructor making sure the allocator is initialized before main
  */
 static void init() {
-  // Initialize mutex for thread safety
-  pthread_mutex_init(&mutex, NULL);
+  ensure_initialized();
+}
+
+/**
+ * @brief Initialize the allocator unless it already is
+ */
+static inline void ensure_initialized() {
+  if (!__atomic_load_n(&isMallocInitialized, __ATOMIC_ACQUIRE)) {
+    pthread_once(&initOnce, initialize_allocator);
+  }
+}
+
+/**
+ * @brief Initialize mutex lock and prepare an initial chunk of memory for allocation
+ */
+static void initialize_allocator() {
+  // Initialize the main arena's mutex and freelists
+  arena * a = &arenas[0];
+  if (MALLOC_HARDENED) {
+    init_hardened_key();
+  }
+  init_size_classes();
+  arena_init(a);
+  pthread_key_create(&tcacheKey, tcache_drain);
+  pthread_key_create(&statsKey, stats_retire);
+  pthread_key_create(&traceKey, trace_retire);
 
 #ifdef DEBUG
   // Manually set printf buffer so it won't call malloc when debugging the allocator
   setvbuf(stdout, NULL, _IONBF, 0);
 #endif // DEBUG
 
+  // Reserve the address space for the slabs, their pages are only backed by
+  // memory once touched
+  if (N_SLAB_CLASSES > 0) {
+    void * region = mmap(NULL, SLAB_REGION_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region != MAP_FAILED) {
+      slabRegion = region;
+    }
+  }
+
   // Allocate the first chunk from the OS
-  header * block = allocate_chunk(ARENA_SIZE);
-  
-  header * prevFencePost = get_header_from_offset(block, -ALLOC_HEADER_SIZE);
-  insert_os_chunk(prevFencePost);
-  
-  lastFencePost = get_header_from_offset(block, get_object_size(block));
-  
+  bool reserved = reserve_os_chunk(a);
+  header * block = allocate_chunk(a, ARENA_SIZE);
+
   // Set the base pointer to the beginning of the first fencepost in the first
   // chunk from the OS
   base = ((char *) block) - ALLOC_HEADER_SIZE; //sizeof(header);
-  
-  
-  // Initialize freelist sentinels
-  for (int i = 0; i < N_LISTS; i++) {
-    header * freelist = &freelistSentinels[i];
-    freelist->next = freelist;
-    freelist->prev = freelist;
+
+  // Insert first chunk into the free list. A chunk that can not be recorded
+  // is left unused, the next growth of the arena then fails cleanly.
+  if (reserved) {
+    header * prevFencePost = get_header_from_offset(block, -ALLOC_HEADER_SIZE);
+    insert_os_chunk(a, prevFencePost);
+    a->lastFencePost = get_header_from_offset(block, get_object_size(block));
+    addtolist(a, block, find_free(get_object_size(block)));
+  }
+  __atomic_store_n(&isMallocInitialized, true, __ATOMIC_RELEASE);
+
+  const char * guard = getenv("MY_MALLOC_GUARD");
+  if (guard != NULL) {
+    my_mallopt(MY_M_GUARD_SAMPLE, strtoul(guard, NULL, 10));
+  }
+
+  const char * profile = getenv("MY_MALLOC_PROFILE");
+  if (profile != NULL && strlen(profile) < sizeof(profilePath)) {
+    strcpy(profilePath, profile);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profile_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(PROFILE_SIGNAL, &action, NULL);
+    my_mallopt(MY_M_PROFILE_SAMPLE, PROFILE_SAMPLE_BYTES);
+  }
+
+  // Registered last as it may allocate, which must find the allocator ready
+  pthread_atfork(fork_prepare, fork_parent, fork_child);
+
+  // Every process gets its own file, programs the traced one runs inherit
+  // the environment
+  if (MALLOC_TRACE) {
+    const char * path = getenv("MY_MALLOC_TRACE");
+    char name[4096];
+    if (path != NULL &&
+        snprintf(name, sizeof(name), "%s.%d", path, (int) getpid()) < (int) sizeof(name)) {
+      my_malloc_trace_start(name);
+    }
   }
- 
-  // Insert first chunk into the free list
-  header * freelist = &freelistSentinels[N_LISTS - 1];
-  freelist->next = block;
-  freelist->prev = block;
-  block->next = freelist;
-  block->prev = freelist;
 }
 
-/* 
+/*
  * External interface
  */
+/**
+ * @brief Allocate a block for my_malloc from guarded pages when the
+ *        guard-page debug mode picks it, otherwise from the tier that serves
+ *        its size: its own mapping, a slab, the thread cache or the freelists
+ *
+ * @param size number of bytes the user needs
+ * @param zeroed if not NULL, set to whether the memory is known to be zero
+ *
+ * @return the user's memory or NULL on failure
+ */
+static inline void * malloc_block(size_t size, bool * zeroed) {
+  if (guard_sampled(size)) {
+    header * hdr = guard_malloc(size);
+    if (hdr != NULL) {
+      if (zeroed != NULL) {
+        *zeroed = true;
+      }
+      return hdr->data;
+    }
+  }
+  if (size >= __atomic_load_n(&mmapThreshold, __ATOMIC_RELAXED)) {
+    header * hdr = allocate_mmapped(size);
+    if (zeroed != NULL) {
+      *zeroed = true;
+    }
+    return hdr ? hdr->data : NULL;
+  }
+  if (zeroed != NULL) {
+    *zeroed = false;
+  }
+  if (size != 0 && size <= SLAB_MAX_SIZE) {
+    void * mem = slab_malloc(size);
+    if (mem != NULL) {
+      return mem;
+    }
+  }
+
+  arena * a = get_arena();
+  header * hdr = tcache_get(a, size);
+  if (hdr != NULL) {
+    return hdr->data;
+  }
+
+  pthread_mutex_lock(&a->mutex);
+  drain_remote_frees(a);
+  hdr = allocate_object(a, size, zeroed);
+  if (MALLOC_CHECK_LEVEL >= CHECK_FULL) {
+    check_heap(a);
+  }
+  pthread_mutex_unlock(&a->mutex);
+  return hdr ? hdr->data : NULL;
+}
+
 void * my_malloc(size_t size) {
-  pthread_mutex_lock(&mutex);
-  header * hdr = allocate_object(size); 
-  pthread_mutex_unlock(&mutex);
-  return hdr;
+  void * mem = malloc_block(size, NULL);
+  if (mem != NULL) {
+    count_op(offsetof(thread_stats, mallocs), 1);
+    trace_op(TRACE_MALLOC, mem, 0, size);
+    profile_malloc(mem, size);
+  }
+  return mem;
 }
 
 void * my_calloc(size_t nmemb, size_t size) {
-  return memset(my_malloc(size * nmemb), 0, size * nmemb);
+  size_t total;
+  if (__builtin_mul_overflow(nmemb, size, &total)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  // Fresh mappings and blocks carved from untouched heap space are already
+  // zero, so only recycled memory needs clearing
+  bool zeroed;
+  void * mem = malloc_block(total, &zeroed);
+  if (mem == NULL) {
+    return NULL;
+  }
+  count_op(offsetof(thread_stats, mallocs), 1);
+  if (!zeroed) {
+    memset(mem, 0, total);
+  }
+  trace_op(TRACE_CALLOC, mem, 0, total);
+  profile_malloc(mem, total);
+  return mem;
 }
 
 void * my_realloc(void * ptr, size_t size) {
-  void * mem = my_malloc(size);
-  memcpy(mem, ptr, size);
-  my_free(ptr);
-  return mem; 
+  count_op(offsetof(thread_stats, reallocs), 1);
+  if (ptr == NULL) {
+    return my_malloc(size);
+  }
+  if (size == 0) {
+    my_free(ptr);
+    return NULL;
+  }
+
+  header * hdr = ptr_to_header(ptr);
+  bool slabObject = is_slab(ptr);
+  if (MALLOC_HARDENED && !slabObject) {
+    check_free(hdr);
+  }
+  size_t oldsize = slabObject ? ptr_to_slab(ptr)->size
+                              : get_object_size(hdr) - ALLOC_HEADER_SIZE;
+  size_t threshold = __atomic_load_n(&mmapThreshold, __ATOMIC_RELAXED);
+  if (slabObject) {
+    // Slab objects have a fixed size, they only fit requests up to it
+    if (size <= oldsize) {
+      trace_op(TRACE_REALLOC, ptr, (uintptr_t) ptr, size);
+      profile_free(ptr);
+      profile_malloc(ptr, size);
+      return ptr;
+    }
+  } else if (get_object_state(hdr) == MMAPPED) {
+    if (size >= threshold) {
+      header * moved = remap_mmapped(hdr, size);
+      if (moved != NULL) {
+        trace_op(TRACE_REALLOC, moved->data, (uintptr_t) ptr, size);
+        profile_free(ptr);
+        profile_malloc(moved->data, size);
+        return moved->data;
+      }
+    }
+  } else if (size < threshold) {
+    // Resize in place using the boundary tags when the neighbours allow it
+    size_t newsize = request_size(size);
+    arena * a = block_arena(hdr);
+    pthread_mutex_lock(&a->mutex);
+    bool resized = newsize <= get_object_size(hdr);
+    if (resized) {
+      shrink_block(a, hdr, newsize);
+    } else {
+      resized = grow_block(a, hdr, newsize);
+    }
+    if (MALLOC_CHECK_LEVEL >= CHECK_FULL) {
+      check_heap(a);
+    }
+    pthread_mutex_unlock(&a->mutex);
+    if (resized) {
+      trace_op(TRACE_REALLOC, ptr, (uintptr_t) ptr, size);
+      profile_free(ptr);
+      profile_malloc(ptr, size);
+      return ptr;
+    }
+  }
+
+  void * mem = malloc_block(size, NULL);
+  if (mem == NULL) {
+    return NULL;
+  }
+  count_op(offsetof(thread_stats, mallocs), 1);
+  memcpy(mem, ptr, oldsize < size ? oldsize : size);
+  // Recorded between taking the new block and releasing the old one
+  trace_op(TRACE_REALLOC, mem, (uintptr_t) ptr, size);
+  profile_free(ptr);
+  profile_malloc(mem, size);
+  count_op(offsetof(thread_stats, frees), 1);
+  if (slabObject) {
+    slab_release(ptr);
+  } else {
+    free_block(ptr);
+  }
+  return mem;
+}
+
+/**
+ * @brief Free a block that is not in a slab, unmapping it, caching it in the
+ *        calling thread or returning it to its arena's freelists
+ *
+ * @param p the user's memory
+ */
+static inline void free_block(void * p) {
+  header * hdr = ptr_to_header(p);
+  if (MALLOC_HARDENED) {
+    check_free(hdr);
+  }
+  if (get_object_state(hdr) == MMAPPED) {
+    deallocate_mmapped(hdr);
+    return;
+  }
+
+  // The block goes back to the arena that owns it, whichever thread frees it
+  arena * a = block_arena(hdr);
+  if (tcache_put(a, hdr)) {
+    return;
+  }
+  // Threads of other arenas never wait for the owner's lock. With checks
+  // enabled they free under the lock so a double free is still caught.
+  if (a != threadArena && MALLOC_CHECK_LEVEL == CHECK_OFF) {
+    push_remote_free(a, p);
+    return;
+  }
+
+  pthread_mutex_lock(&a->mutex);
+  deallocate_object(a, p);
+  if (MALLOC_CHECK_LEVEL >= CHECK_FULL) {
+    check_heap(a);
+  }
+  pthread_mutex_unlock(&a->mutex);
 }
 
 void my_free(void * p) {
-  pthread_mutex_lock(&mutex);
-  deallocate_object(p);
-  pthread_mutex_unlock(&mutex);
+  if (p == NULL) {
+    return;
+  }
+  count_op(offsetof(thread_stats, frees), 1);
+  trace_op(TRACE_FREE, p, 0, 0);
+  profile_free(p);
+  if (is_slab(p)) {
+    slab_release(p);
+    return;
+  }
+  free_block(p);
+}
+
+void my_free_sized(void * p, size_t size) {
+  if (p == NULL) {
+    return;
+  }
+  if (MALLOC_CHECK_LEVEL >= CHECK_CHEAP && size > my_malloc_usable_size(p)) {
+    fprintf(stderr, "%s\n", "Invalid Free Size Detected");
+    assert(0);
+  }
+  count_op(offsetof(thread_stats, frees), 1);
+  trace_op(TRACE_FREE, p, 0, 0);
+  profile_free(p);
+  // Only requests of up to SLAB_MAX_SIZE bytes ever come from a slab
+  if (size <= SLAB_MAX_SIZE && is_slab(p)) {
+    slab_release(p);
+    return;
+  }
+
+  // The size picks the cache list without decoding the block's size from its
+  // header. A block left whole because its remainder was too small to split
+  // is cached with the blocks of its request, which only means a later
+  // request gets a little more than it asked for. Like the slab caches the
+  // lists are only searched for a double free when checks are enabled.
+  // Hardened builds check every free through free_block.
+  int list = find_free(request_size(size));
+  if (!MALLOC_HARDENED && size != 0 && list < N_TCACHE_LISTS) {
+    header * hdr = ptr_to_header(p);
+    arena * a = block_arena(hdr);
+    if (get_object_state(hdr) == ALLOCATED && a == threadArena) {
+      if (MALLOC_CHECK_LEVEL >= CHECK_CHEAP) {
+        list = find_free(get_object_size(hdr));
+      }
+      if (tcache_put_list(a, hdr, list, MALLOC_CHECK_LEVEL >= CHECK_CHEAP)) {
+        return;
+      }
+    }
+  }
+  free_block(p);
+}
+
+size_t my_malloc_batch(size_t size, size_t n, void ** out) {
+  if (size == 0) {
+    return 0;
+  }
+
+  size_t count = 0;
+  size_t threshold = __atomic_load_n(&mmapThreshold, __ATOMIC_RELAXED);
+  if (size >= threshold) {
+    for (; count < n; count++) {
+      header * hdr = allocate_mmapped(size);
+      if (hdr == NULL) {
+        break;
+      }
+      out[count] = hdr->data;
+    }
+  } else {
+    arena * a = get_arena();
+    pthread_mutex_lock(&a->mutex);
+    drain_remote_frees(a);
+    if (size <= SLAB_MAX_SIZE && slabRegion != NULL) {
+      for (; count < n; count++) {
+        void * p = slab_alloc(a, (size - 1) / MALLOC_ALIGNMENT);
+        if (p == NULL) {
+          break;
+        }
+        out[count] = p;
+      }
+    }
+    count += allocate_batch(a, size, n - count, out + count);
+    if (MALLOC_CHECK_LEVEL >= CHECK_FULL) {
+      check_heap(a);
+    }
+    pthread_mutex_unlock(&a->mutex);
+  }
+  count_op(offsetof(thread_stats, mallocs), count);
+  for (size_t i = 0; i < count; i++) {
+    trace_op(TRACE_MALLOC, out[i], 0, size);
+    profile_malloc(out[i], size);
+  }
+  return count;
+}
+
+/**
+ * @brief Sort pointers by address in place. Arrays already in ascending or
+ * descending order, as batches usually are, cost a single pass; anything
+ * else is quicksorted with an insertion sort for short ranges.
+ *
+ * @param ptrs the pointers to sort
+ * @param n the number of pointers
+ */
+static void sort_pointers(void ** ptrs, size_t n) {
+  size_t ascending = 1;
+  size_t descending = 1;
+  for (size_t i = 1; i < n; i++) {
+    ascending += ptrs[i - 1] <= ptrs[i];
+    descending += ptrs[i - 1] >= ptrs[i];
+  }
+  if (n < 2 || ascending == n) {
+    return;
+  }
+  if (descending == n) {
+    for (size_t i = 0, j = n - 1; i < j; i++, j--) {
+      void * t = ptrs[i];
+      ptrs[i] = ptrs[j];
+      ptrs[j] = t;
+    }
+    return;
+  }
+
+  while (n > 16) {
+    // Partition around the median of the first, middle and last pointers
+    void * a = ptrs[0], * b = ptrs[n / 2], * c = ptrs[n - 1];
+    void * pivot = a < b ? (b < c ? b : (a < c ? c : a))
+                         : (a < c ? a : (b < c ? c : b));
+    size_t i = 0;
+    size_t j = n - 1;
+    for (;;) {
+      while (ptrs[i] < pivot) {
+        i++;
+      }
+      while (ptrs[j] > pivot) {
+        j--;
+      }
+      if (i >= j) {
+        break;
+      }
+      void * t = ptrs[i];
+      ptrs[i++] = ptrs[j];
+      ptrs[j--] = t;
+    }
+    // Recurse into the smaller side and loop on the larger one
+    if (j + 1 < n - j - 1) {
+      sort_pointers(ptrs, j + 1);
+      ptrs += j + 1;
+      n -= j + 1;
+    } else {
+      sort_pointers(ptrs + j + 1, n - j - 1);
+      n = j + 1;
+    }
+  }
+  for (size_t i = 1; i < n; i++) {
+    void * p = ptrs[i];
+    size_t j = i;
+    for (; j > 0 && ptrs[j - 1] > p; j--) {
+      ptrs[j] = ptrs[j - 1];
+    }
+    ptrs[j] = p;
+  }
+}
+
+void my_free_batch(void ** ptrs, size_t n) {
+  // Free the slab objects and mapped blocks right away, gathering the heap
+  // blocks at the front of the array
+  size_t freed = 0;
+  size_t heap = 0;
+  for (size_t i = 0; i < n; i++) {
+    void * p = ptrs[i];
+    if (p == NULL) {
+      continue;
+    }
+    freed++;
+    trace_op(TRACE_FREE, p, 0, 0);
+    profile_free(p);
+    if (is_slab(p)) {
+      slab_release(p);
+      continue;
+    }
+    if (MALLOC_HARDENED) {
+      check_free(ptr_to_header(p));
+    }
+    if (get_object_state(ptr_to_header(p)) == MMAPPED) {
+      deallocate_mmapped(ptr_to_header(p));
+    } else {
+      ptrs[heap++] = p;
+    }
+  }
+
+  // Freeing in address order merges each block with the one freed before
+  // it, and blocks of one arena end up next to each other
+  sort_pointers(ptrs, heap);
+  arena * locked = NULL;
+  for (size_t i = 0; i < heap; i++) {
+    header * hdr = ptr_to_header(ptrs[i]);
+    arena * a = block_arena(hdr);
+    if (a != locked) {
+      if (locked != NULL) {
+        if (MALLOC_CHECK_LEVEL >= CHECK_FULL) {
+          check_heap(locked);
+        }
+        pthread_mutex_unlock(&locked->mutex);
+      }
+      pthread_mutex_lock(&a->mutex);
+      locked = a;
+    }
+    if (a == threadArena && TCACHE_COUNT > 0) {
+      tcache_check_double_free(&threadCache, hdr);
+    }
+    deallocate_object(a, ptrs[i]);
+  }
+  if (locked != NULL) {
+    if (MALLOC_CHECK_LEVEL >= CHECK_FULL) {
+      check_heap(locked);
+    }
+    pthread_mutex_unlock(&locked->mutex);
+  }
+  count_op(offsetof(thread_stats, frees), freed);
+}
+
+size_t my_malloc_usable_size(void * p) {
+  if (p == NULL) {
+    return 0;
+  }
+  if (is_slab(p)) {
+    return ptr_to_slab(p)->size;
+  }
+  return get_object_size(ptr_to_header(p)) - ALLOC_HEADER_SIZE;
+}
+
+void * my_memalign(size_t alignment, size_t size) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  // Every block is already aligned to MALLOC_ALIGNMENT bytes
+  if (alignment <= MALLOC_ALIGNMENT) {
+    return my_malloc(size);
+  }
+
+  header * hdr;
+  if (size >= __atomic_load_n(&mmapThreshold, __ATOMIC_RELAXED)) {
+    hdr = allocate_mmapped_aligned(alignment, size);
+  } else {
+    arena * a = get_arena();
+    pthread_mutex_lock(&a->mutex);
+    drain_remote_frees(a);
+    hdr = allocate_aligned(a, alignment, size);
+    if (MALLOC_CHECK_LEVEL >= CHECK_FULL) {
+      check_heap(a);
+    }
+    pthread_mutex_unlock(&a->mutex);
+    if (hdr == NULL) {
+      // The slack of a large alignment may not fit in a region of a
+      // non-main arena, a mapping of its own always does
+      hdr = allocate_mmapped_aligned(alignment, size);
+    }
+  }
+  if (hdr == NULL) {
+    return NULL;
+  }
+  count_op(offsetof(thread_stats, mallocs), 1);
+  trace_op(TRACE_MEMALIGN, hdr->data, alignment, size);
+  profile_malloc(hdr->data, size);
+  return hdr->data;
+}
+
+int my_posix_memalign(void ** memptr, size_t alignment, size_t size) {
+  if (alignment == 0 || alignment % sizeof(void *) != 0 ||
+      (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
+  }
+  void * mem = my_memalign(alignment, size);
+  if (mem == NULL && size != 0) {
+    return ENOMEM;
+  }
+  *memptr = mem;
+  return 0;
+}
+
+void * my_aligned_alloc(size_t alignment, size_t size) {
+  return my_memalign(alignment, size);
+}
+
+int my_malloc_trim(size_t pad) {
+  bool released = false;
+  for (int i = 0; i < N_ARENAS; i++) {
+    arena * a = &arenas[i];
+    if (!__atomic_load_n(&a->initialized, __ATOMIC_ACQUIRE)) {
+      continue;
+    }
+    pthread_mutex_lock(&a->mutex);
+    drain_remote_frees(a);
+    released |= trim_top(a, pad);
+    for (int l = 0; l < N_LISTS; l++) {
+      header * freelist = &a->freelistSentinels[l];
+      for (header * cur = get_next(freelist); cur != freelist; cur = get_next(cur)) {
+        released |= release_block_pages(cur, MADV_DONTNEED) != 0;
+      }
+    }
+    pthread_mutex_unlock(&a->mutex);
+  }
+  return released;
+}
+
+int my_mallopt(int param, size_t value) {
+  switch (param) {
+    case MY_M_MMAP_THRESHOLD:
+      // Blocks this large must still fit in a non-main arena's region
+      if (value > HEAP_SIZE / 2) {
+        return 0;
+      }
+      __atomic_store_n(&mmapThreshold, value, __ATOMIC_RELAXED);
+      return 1;
+    case MY_M_MAX_CHUNK_SIZE:
+      if (value < ARENA_SIZE || value > HEAP_SIZE / 2) {
+        return 0;
+      }
+      value &= ~(size_t) (ARENA_SIZE - 1);
+      __atomic_store_n(&maxChunkSize, value, __ATOMIC_RELAXED);
+      return 1;
+    case MY_M_TRIM_THRESHOLD:
+      __atomic_store_n(&trimThreshold, value, __ATOMIC_RELAXED);
+      return 1;
+    case MY_M_GUARD_SAMPLE:
+      // Intervals between guarded allocations go up to twice the rate
+      if (value > SIZE_MAX / 2) {
+        return 0;
+      }
+      __atomic_store_n(&guardSample, value, __ATOMIC_RELAXED);
+      return 1;
+    case MY_M_PROFILE_SAMPLE:
+      __atomic_store_n(&profileRate, value, __ATOMIC_RELAXED);
+      return 1;
+  }
+  return 0;
+}
+
+malloc_stats my_malloc_stats() {
+  malloc_stats stats;
+  memset(&stats, 0, sizeof(stats));
+  for (int i = 0; i < N_ARENAS; i++) {
+    arena * a = &arenas[i];
+    if (!__atomic_load_n(&a->initialized, __ATOMIC_ACQUIRE)) {
+      continue;
+    }
+    pthread_mutex_lock(&a->mutex);
+    drain_remote_frees(a);
+    arena_stats(a, &stats);
+    pthread_mutex_unlock(&a->mutex);
+  }
+
+  stats.mmapped_bytes = __atomic_load_n(&mmappedBytes, __ATOMIC_RELAXED);
+  stats.mmapped_blocks = __atomic_load_n(&mmappedBlocks, __ATOMIC_RELAXED);
+  stats.os_bytes += stats.mmapped_bytes;
+  stats.in_use_bytes += stats.mmapped_bytes;
+
+  // The sentinel holds the totals of the exited threads
+  pthread_mutex_lock(&statsMutex);
+  thread_stats * ts = &statsList;
+  do {
+    stats.mallocs += __atomic_load_n(&ts->mallocs, __ATOMIC_RELAXED);
+    stats.frees += __atomic_load_n(&ts->frees, __ATOMIC_RELAXED);
+    stats.reallocs += __atomic_load_n(&ts->reallocs, __ATOMIC_RELAXED);
+    ts = ts->next;
+  } while (ts != &statsList);
+  pthread_mutex_unlock(&statsMutex);
+  return stats;
 }
 
 bool verify() {
-  return verify_freelist() && verify_tags();
+  for (int i = 0; i < N_ARENAS; i++) {
+    if (arenas[i].initialized && !verify_arena(&arenas[i])) {
+      return false;
+    }
+  }
+  return true;
 }
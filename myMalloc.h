@@ -1,21 +1,215 @@
 #ifndef MY_MALLOC_H
 #define MY_MALLOC_H
 
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 #define RELATIVE_POINTERS true
 
 #ifndef ARENA_SIZE
-// If not specified at compile time use the default arena size
+// If not specified at compile time use the default arena size, the size of
+// the first chunk and the granule all chunk sizes are rounded to, must be a
+// power of two
 #define ARENA_SIZE 4096
 #endif
 
-#ifndef N_LISTS
-// If not specified at compile time use the default number of free lists
-#define N_LISTS 59
+#ifndef MAX_CHUNK_SIZE
+// If not specified at compile time stop doubling the size of the chunks
+// requested from the OS once they reach 4MiB
+#define MAX_CHUNK_SIZE (4 * 1024 * 1024)
 #endif
 
+#ifndef MALLOC_ALIGNMENT
+// If not specified at compile time align the data of every block to 16
+// bytes, the alignment of max_align_t on x86-64 that programs using the
+// library as their malloc rely on. Must be a power of two of at least 8
+#define MALLOC_ALIGNMENT 16
+#endif
+
+#ifndef SMALL_CLASS_SHIFT
+// If not specified at compile time give blocks below 512 bytes one freelist
+// per size, block sizes step by MALLOC_ALIGNMENT
+#define SMALL_CLASS_SHIFT 9
+#endif
+
+#ifndef LARGE_CLASS_SHIFT
+// If not specified at compile time give blocks below 256KiB logarithmic
+// freelists, larger blocks share the last freelist
+#define LARGE_CLASS_SHIFT 18
+#endif
+
+#ifndef SIZE_CLASS_SPLIT
+// If not specified at compile time split every power of two between the
+// small and large limits into 4 freelists, must be a power of two
+#define SIZE_CLASS_SPLIT 4
+#endif
+
+/* Number of freelists holding a single block size, from the 32 byte minimum
+ * block up to the small limit in steps of MALLOC_ALIGNMENT
+ */
+#define N_EXACT_LISTS (((1 << SMALL_CLASS_SHIFT) - 32) / MALLOC_ALIGNMENT)
+
+/* Number of freelists: the exact lists, SIZE_CLASS_SPLIT lists per power of
+ * two up to the large limit, and one list for every larger block
+ */
+#define N_LISTS (N_EXACT_LISTS + \
+                 (LARGE_CLASS_SHIFT - SMALL_CLASS_SHIFT) * SIZE_CLASS_SPLIT + 1)
+
+/* Placement policies for the freelists holding a range of sizes
+ *
+ * FIT_FIRST take the first block that fits, in the order blocks were freed
+ * FIT_BEST  probe up to BEST_FIT_PROBES blocks and take the smallest that
+ *           fits, stopping early on an exact fit
+ */
+#define FIT_FIRST 0
+#define FIT_BEST 1
+
+#ifndef FIT_POLICY
+// If not specified at compile time use best fit
+#define FIT_POLICY FIT_BEST
+#endif
+
+#ifndef BEST_FIT_PROBES
+// If not specified at compile time probe at most 16 blocks per freelist for
+// the best fit
+#define BEST_FIT_PROBES 16
+#endif
+
+#ifndef TCACHE_COUNT
+// If not specified at compile time cache up to 32 blocks per size class in
+// each thread, 0 disables the thread caches
+#define TCACHE_COUNT 32
+#endif
+
+/* Number of blocks moved between a thread cache and the freelists at once */
+#define TCACHE_BATCH (TCACHE_COUNT / 2 > 0 ? TCACHE_COUNT / 2 : 1)
+
+/* Thread caches hold blocks of the exact size classes, where every block of
+ * a list fits every request mapped to it
+ */
+#define N_TCACHE_LISTS N_EXACT_LISTS
+
+/* Levels of internal consistency checking done by the allocator
+ *
+ * CHECK_OFF   no checks, the allocation path never walks the heap
+ * CHECK_CHEAP constant time checks of the boundary tags and freelist
+ *             pointers of each block that is allocated or freed
+ * CHECK_FULL  cheap checks plus a verify() of the whole heap after every
+ *             call to my_malloc and my_free
+ */
+#define CHECK_OFF 0
+#define CHECK_CHEAP 1
+#define CHECK_FULL 2
+
+#ifndef MALLOC_CHECK_LEVEL
+// If not specified at compile time use full checks for debug builds and no
+// checks otherwise
+#ifdef DEBUG
+#define MALLOC_CHECK_LEVEL CHECK_FULL
+#else
+#define MALLOC_CHECK_LEVEL CHECK_OFF
+#endif
+#endif
+
+#ifndef N_ARENAS
+// If not specified at compile time use the default number of arenas
+#define N_ARENAS 8
+#endif
+
+#ifndef HEAP_SIZE
+// If not specified at compile time use the default size of the aligned
+// regions non-main arenas allocate their chunks from, must be a power of two
+#define HEAP_SIZE (64 * 1024 * 1024)
+#endif
+
+#ifndef MMAP_THRESHOLD
+// If not specified at compile time serve requests of 128KiB and up from
+// their own mapping
+#define MMAP_THRESHOLD (128 * 1024)
+#endif
+
+#ifndef TRIM_THRESHOLD
+// If not specified at compile time release memory to the OS automatically
+// when a free block of twice the maximum chunk size forms
+#define TRIM_THRESHOLD (2 * MAX_CHUNK_SIZE)
+#endif
+
+#ifndef SLAB_MAX_SIZE
+// If not specified at compile time serve requests of up to 32 bytes from
+// slabs of same-size objects that carry no header, 0 disables the slabs. Must
+// be a multiple of MALLOC_ALIGNMENT
+#define SLAB_MAX_SIZE 32
+#endif
+
+#ifndef SLAB_SIZE
+// If not specified at compile time use page-sized slabs, must be a power of
+// two
+#define SLAB_SIZE 4096
+#endif
+
+#ifndef SLAB_REGION_SIZE
+// If not specified at compile time reserve 1GiB of address space for the
+// slabs, requests fall back to the freelists once it is used up
+#define SLAB_REGION_SIZE ((size_t) 1 << 30)
+#endif
+
+#ifndef MALLOC_TRACE
+// If not specified at compile time leave the trace recorder out, 1 compiles
+// it in and starts recording at startup to the file named by the
+// MY_MALLOC_TRACE environment variable followed by the process id, if it is
+// set
+#define MALLOC_TRACE 0
+#endif
+
+#ifndef MALLOC_HARDENED
+// If not specified at compile time leave hardening out, 1 seals every header
+// with a keyed checksum that is verified on free and before coalescing,
+// checks that freed blocks lie in a chunk of their arena and stores the links
+// kept in free memory obfuscated with the key
+#define MALLOC_HARDENED 0
+#endif
+
+#ifndef GUARD_QUARANTINE
+// If not specified at compile time keep the pages of the last 1024 freed
+// guarded blocks inaccessible before unmapping them, so a use after free
+// faults for as long as possible
+#define GUARD_QUARANTINE 1024
+#endif
+
+#ifndef TRACE_BUFFER_RECORDS
+// If not specified at compile time let each thread buffer 512 trace records
+// before appending them to the trace file
+#define TRACE_BUFFER_RECORDS 512
+#endif
+
+#ifndef PROFILE_SAMPLE_BYTES
+// If not specified at compile time let the heap profiler sample one
+// allocation per 512KiB allocated on average once it is enabled
+#define PROFILE_SAMPLE_BYTES (512 * 1024)
+#endif
+
+#ifndef PROFILE_MAX_FRAMES
+// If not specified at compile time record up to 32 frames of the stack of
+// each sampled allocation
+#define PROFILE_MAX_FRAMES 32
+#endif
+
+#ifndef PROFILE_SIGNAL
+// If not specified at compile time write a heap profile on SIGUSR2 when the
+// profiler is enabled through the MY_MALLOC_PROFILE environment variable
+#define PROFILE_SIGNAL SIGUSR2
+#endif
+
+/* Slab objects come in steps of MALLOC_ALIGNMENT bytes, one size class per
+ * step */
+#define N_SLAB_CLASSES (SLAB_MAX_SIZE / MALLOC_ALIGNMENT)
+
+/* Number of bytes in the freelist bitmap, one bit per freelist */
+#define BITMAP_SIZE ((N_LISTS + 7) / 8)
+
 /* Size of the header for an allocated block
  *
  * The size of the normal minus the size of the two free list pointers as
@@ -36,6 +230,7 @@ enum state {
   UNALLOCATED = 0,
   ALLOCATED = 1,
   FENCEPOST = 2,
+  MMAPPED = 3,
 };
 
 /*
@@ -62,9 +257,11 @@ enum state {
  * header * prev The previous block in the free list (only valid if free)
  *
  * FIELD PRESENT WHEN ALLOCATED
- * size_t[] canary magic value to detetmine if a block as been corrupted
- *
  * char[] data first byte of data pointed to by the list
+ *
+ * Hardened builds keep a keyed checksum of the block's address, size and
+ * state in the top bits of object_size_and_state, and store next and prev
+ * obfuscated with the same key
  */
 typedef struct header {
   size_t object_size_and_state;
@@ -84,13 +281,52 @@ typedef struct header {
 // Since the size is a multiple of 8, the last 3 bits are always 0s.
 // Therefore we use the 3 lowest bits to store the state of the object.
 // This is going to save 8 bytes in all objects.
+//
+// The two lowest bits hold the state, the third is set on every block that
+// belongs to an arena other than the main arena. Blocks mapped on their own
+// belong to no arena, there the third bit marks a block of the guard-page
+// debug mode.
+#define NON_MAIN_ARENA 0x4
+#define GUARDED 0x4
+
+// No block comes near 2^48 bytes, so hardened builds keep a 16 bit checksum
+// of the rest of the header word and the header's address above the size.
+#define CHECKSUM_SHIFT 48
+#define CHECKSUM_MASK (~(size_t) 0 << CHECKSUM_SHIFT)
+#define SIZE_MASK (~CHECKSUM_MASK & ~(size_t) 0x7)
+
+/*
+ * Random key of the hardened checks, chosen at startup
+ */
+extern uintptr_t hardenedKey;
+
+static inline size_t header_checksum(header * h) {
+	uint64_t x = ((h->object_size_and_state & ~CHECKSUM_MASK) ^ (uintptr_t) h) * (hardenedKey | 1);
+	x ^= x >> 29;
+	x *= 0xbf58476d1ce4e5b9;
+	return x >> CHECKSUM_SHIFT;
+}
+
+// Recompute the checksum after any change to the header word
+static inline void seal_header(header * h) {
+	if (MALLOC_HARDENED) {
+		h->object_size_and_state = (h->object_size_and_state & ~CHECKSUM_MASK)
+		                           | (header_checksum(h) << CHECKSUM_SHIFT);
+	}
+}
+
+static inline bool header_intact(header * h) {
+	return !MALLOC_HARDENED ||
+	       h->object_size_and_state >> CHECKSUM_SHIFT == header_checksum(h);
+}
 
 static inline size_t get_object_size(header * h) {
-	return h->object_size_and_state & ~0x3;
+	return h->object_size_and_state & SIZE_MASK;
 }
 
 static inline void set_object_size(header * h, size_t size) {
-	h->object_size_and_state = size | (h->object_size_and_state & 0x3);
+	h->object_size_and_state = size | (h->object_size_and_state & 0x7);
+	seal_header(h);
 }
 
 static inline enum  state get_object_state(header *h) {
@@ -99,13 +335,89 @@ static inline enum  state get_object_state(header *h) {
 
 static inline void set_object_state(header * h, enum state s) {
 	h->object_size_and_state = (h->object_size_and_state & ~0x3) | s;
+	seal_header(h);
 }
 
 static inline void set_block_object_size_and_state(header * h, size_t size, enum state s) {
-	h->object_size_and_state=(size & ~0x3)|(s &0x3);
+	h->object_size_and_state=(size & ~0x7)|(h->object_size_and_state & NON_MAIN_ARENA)|(s &0x3);
+	seal_header(h);
+}
+
+// Links stored in free memory. Hardened builds xor them with the key and the
+// address they are stored at, so a pointer written over freed memory by an
+// overflow or a use after free decodes to an unpredictable address. The
+// encoding is its own inverse.
+static inline void * protect_pointer(void * where, void * p) {
+	if (!MALLOC_HARDENED) {
+		return p;
+	}
+	return (void *) ((uintptr_t) p ^ ((uintptr_t) where >> 12) ^ hardenedKey);
+}
+
+static inline header * get_next(header * h) {
+	return (header *) protect_pointer(&h->next, h->next);
 }
 
-#define MAX_OS_CHUNKS 1024
+static inline header * get_prev(header * h) {
+	return (header *) protect_pointer(&h->prev, h->prev);
+}
+
+static inline void set_next(header * h, header * next) {
+	h->next = (header *) protect_pointer(&h->next, next);
+}
+
+static inline void set_prev(header * h, header * prev) {
+	h->prev = (header *) protect_pointer(&h->prev, prev);
+}
+
+/*
+ * An arena is an independent heap with its own lock, freelists and chunks
+ * from the OS. Threads are spread over the arenas so they do not contend on
+ * a single lock, and a freed block always returns to the arena it came from.
+ *
+ * pthread_mutex_t mutex Lock protecting every other field
+ * header[] freelistSentinels Sentinel nodes for the freelists
+ * char[] freelist_bitmap One bit per freelist, set while the list is non-empty
+ * header * lastFencePost The second fencepost in the most recently allocated
+ *   chunk from the OS. Used for coalescing chunks
+ * header ** osChunkList List of chunks allocated by the OS for printing
+ *   boundary tags, grown as needed
+ * header ** osChunkEnds Right fencepost of each chunk but the last, whose
+ *   end is lastFencePost. Old lists stay mapped in hardened builds, where
+ *   frees search them without the lock
+ * size_t nextChunkSize Size of the next chunk to request from the OS
+ * struct heap_info * currentHeap Region non-main arenas carve chunks from
+ * struct slab *[] partialSlabs Slabs of each class with a free slot
+ * struct slab * emptySlabs Slabs with every slot free, reused by any class
+ * size_t slabBytes Bytes of the slab region the arena's slabs occupy
+ * size_t slabInUseBytes Bytes of slab objects handed out
+ * char * zeroStart, zeroEnd Range of free memory never written since it came
+ *   from the OS, so calloc can hand it out without clearing it
+ * void * remoteFrees Blocks and slab objects freed by threads of other
+ *   arenas, pushed without taking the lock and freed by the next thread that
+ *   takes it to allocate
+ */
+typedef struct arena {
+  pthread_mutex_t mutex;
+  header freelistSentinels[N_LISTS];
+  char freelist_bitmap[BITMAP_SIZE];
+  header * lastFencePost;
+  header ** osChunkList;
+  header ** osChunkEnds;
+  size_t numOsChunks;
+  size_t maxOsChunks;
+  size_t nextChunkSize;
+  struct heap_info * currentHeap;
+  struct slab * partialSlabs[N_SLAB_CLASSES];
+  struct slab * emptySlabs;
+  size_t slabBytes;
+  size_t slabInUseBytes;
+  char * zeroStart;
+  char * zeroEnd;
+  void * remoteFrees;
+  int index;
+  bool initialized;
+} arena;
 
 // Malloc interface
 void * my_malloc(size_t size);
@@ -113,6 +425,185 @@ void * my_calloc(size_t nmemb, size_t size);
 void * my_realloc(void * ptr, size_t size);
 void my_free(void * p);
 
+/* Free a block whose size the caller knows. size must lie between the size
+ * it was last allocated or reallocated with and its usable size, which lets
+ * the free skip the slab lookup for larger blocks
+ */
+void my_free_sized(void * p, size_t size);
+
+/* Allocate n blocks of size bytes under a single acquisition of the lock,
+ * carving them back to back from one free block where possible. Stores the
+ * blocks in out and returns how many were allocated, fewer than n only when
+ * memory runs out
+ */
+size_t my_malloc_batch(size_t size, size_t n, void ** out);
+
+/* Free n blocks, skipping NULL entries, taking each arena's lock once and
+ * freeing in address order so neighbouring blocks coalesce. The contents of
+ * ptrs are reordered
+ */
+void my_free_batch(void ** ptrs, size_t n);
+
+/* Number of bytes the caller may use in a block, at least the size it was
+ * allocated with. Writing up to this size is safe and realloc keeps it
+ */
+size_t my_malloc_usable_size(void * p);
+
+// Aligned allocation interface, alignment must be a power of two
+void * my_memalign(size_t alignment, size_t size);
+int my_posix_memalign(void ** memptr, size_t alignment, size_t size);
+void * my_aligned_alloc(size_t alignment, size_t size);
+
+// Tuning parameters for my_mallopt
+#define MY_M_MMAP_THRESHOLD 1
+#define MY_M_MAX_CHUNK_SIZE 2
+#define MY_M_TRIM_THRESHOLD 3
+#define MY_M_GUARD_SAMPLE 4
+#define MY_M_PROFILE_SAMPLE 5
+
+/* Set a tuning parameter at runtime, returns 1 on success and 0 on error
+ *
+ * MY_M_MMAP_THRESHOLD requests of at least this many bytes are mapped
+ *                     directly from the OS and unmapped when freed
+ * MY_M_MAX_CHUNK_SIZE upper bound on the chunks arenas grow by, rounded down
+ *                     to a multiple of ARENA_SIZE
+ * MY_M_TRIM_THRESHOLD freeing a block of at least this many bytes returns
+ *                     memory to the OS, shrinking the arena if the block is
+ *                     at its end and keeping half the threshold free. 0
+ *                     disables automatic trimming
+ * MY_M_GUARD_SAMPLE   serve about one allocation in this many from pages of
+ *                     its own, ending right at an inaccessible guard page
+ *                     and made inaccessible when freed, so an overflow or a
+ *                     use after free faults on the spot. 1 guards every
+ *                     allocation and 0, the default, none. The
+ *                     MY_MALLOC_GUARD environment variable sets it at
+ *                     startup
+ * MY_M_PROFILE_SAMPLE mean number of bytes allocated between two
+ *                     allocations the heap profiler samples, 0, the
+ *                     default, stops sampling. Setting the
+ *                     MY_MALLOC_PROFILE environment variable starts the
+ *                     profiler with PROFILE_SAMPLE_BYTES
+ */
+int my_mallopt(int param, size_t value);
+
+/* Return free memory to the OS: shrink every arena whose end is free down to
+ * pad free bytes and release the whole pages inside every free block. Returns
+ * 1 if any memory was released and 0 otherwise
+ */
+int my_malloc_trim(size_t pad);
+
+/*
+ * Snapshot of the allocator returned by my_malloc_stats
+ *
+ * size_t os_bytes Bytes currently obtained from the OS: arena chunks, slab
+ *   pages and blocks mapped on their own
+ * size_t in_use_bytes Bytes of allocated blocks including their headers,
+ *   counting blocks held in thread caches as allocated
+ * size_t free_bytes Bytes of free blocks in the arenas' freelists
+ * size_t[] free_bytes_per_list Free bytes in each freelist, indexed like
+ *   the freelists
+ * size_t mmapped_bytes Bytes of the blocks mapped on their own
+ * size_t mmapped_blocks Number of blocks mapped on their own
+ * size_t chunks Number of separate chunks the arenas got from the OS
+ * size_t largest_free Size of the largest free block
+ * size_t mallocs Blocks handed out since startup by every allocation call
+ * size_t frees Blocks released since startup, by my_free or a moving
+ *   my_realloc
+ * size_t reallocs Calls to my_realloc since startup
+ */
+typedef struct malloc_stats {
+  size_t os_bytes;
+  size_t in_use_bytes;
+  size_t free_bytes;
+  size_t free_bytes_per_list[N_LISTS];
+  size_t mmapped_bytes;
+  size_t mmapped_blocks;
+  size_t chunks;
+  size_t largest_free;
+  size_t mallocs;
+  size_t frees;
+  size_t reallocs;
+} malloc_stats;
+
+/* Take a snapshot of the allocator's memory use and operation counts. Each
+ * arena is walked under its own lock, so the snapshot costs time linear in
+ * the number of blocks and is only consistent per arena
+ */
+malloc_stats my_malloc_stats();
+
+/* Calls recorded in an allocation trace */
+enum trace_op {
+  TRACE_MALLOC = 0,
+  TRACE_CALLOC = 1,
+  TRACE_REALLOC = 2,
+  TRACE_FREE = 3,
+  TRACE_MEMALIGN = 4,
+};
+
+/* A trace file starts with a trace_file_header followed by trace_records,
+ * both in the byte order of the machine that recorded them
+ */
+#define TRACE_MAGIC "MYMTRACE"
+#define TRACE_VERSION 1
+
+typedef struct trace_file_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+} trace_file_header;
+
+/*
+ * One call recorded in an allocation trace. Only calls that succeeded are
+ * recorded, and a realloc that reduced to a malloc or free is recorded as one
+ *
+ * uint64_t seq Position of the call in the trace. Threads append their
+ *   records in batches, so the file is only in call order once sorted by seq
+ * uint64_t time Nanoseconds since the trace started
+ * uint64_t ptr Id of the block returned or freed, its address. Ids are
+ *   reused once the block is freed
+ * uint64_t arg Id of the block a realloc resized or the alignment of a
+ *   memalign, 0 otherwise
+ * uint64_t size Bytes requested, the product of both arguments for calloc
+ * uint32_t thread Number of the calling thread, counting from 1 in the order
+ *   threads first made a recorded call
+ * uint32_t op The trace_op of the call
+ */
+typedef struct trace_record {
+  uint64_t seq;
+  uint64_t time;
+  uint64_t ptr;
+  uint64_t arg;
+  uint64_t size;
+  uint32_t thread;
+  uint32_t op;
+} trace_record;
+
+/* Start recording every allocation call to a new trace file at path. Returns
+ * false if the recorder is not compiled in, a trace is already being
+ * recorded or the file can not be created
+ */
+bool my_malloc_trace_start(const char * path);
+
+/* Stop recording and close the trace file. The calling thread's records are
+ * written out, records other threads have not written out yet are lost
+ */
+void my_malloc_trace_stop();
+
+/* Write a profile of the live sampled allocations to a new file at path, in
+ * the text format of gperftools heap profiles that pprof reads: one line per
+ * allocation with its size and the return addresses of its stack, followed
+ * by the memory map of the process to symbolize them. Each allocation is
+ * sampled with a probability that grows with its size, and pprof scales the
+ * samples back up by the sampling rate in the header.
+ *
+ * When the MY_MALLOC_PROFILE environment variable is set at startup, the
+ * profiler starts and PROFILE_SIGNAL writes a profile to the file it names
+ * followed by the process id and the number of the profile. The profile is
+ * written by the next thread that samples an allocation, not by the signal
+ * handler. Returns false if the file can not be written
+ */
+bool my_malloc_profile_dump(const char * path);
+
 // Debug list verifitcation
 bool verify();
 
@@ -126,9 +617,6 @@ header * get_right_header(header * h);
  * will be present when the final binary is linked
  */
 extern void * base;
-extern header freelistSentinels[];
-extern char freelist_bitmap[];
-extern header * osChunkList[];
-extern size_t numOsChunks;
+extern arena arenas[];
 
 #endif // MY_MALLOC_H
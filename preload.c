@@ -0,0 +1,49 @@
+#include <stddef.h>
+
+#include "myMalloc.h"
+
+/*
+ * Standard allocation functions forwarding to the allocator, so a shared
+ * library built from this file and the allocator replaces the C library's
+ * malloc in an unmodified program through LD_PRELOAD:
+ *
+ *   make preload
+ *   LD_PRELOAD=./libmymalloc.so program
+ *
+ * The library must be built with the initial-exec TLS model so the
+ * allocator's thread-local state never needs an allocation of its own, and
+ * with a MALLOC_ALIGNMENT of at least 16 so blocks meet the alignment of
+ * max_align_t that programs expect from malloc.
+ */
+
+void * malloc(size_t size) {
+  return my_malloc(size);
+}
+
+void free(void * p) {
+  my_free(p);
+}
+
+void * calloc(size_t nmemb, size_t size) {
+  return my_calloc(nmemb, size);
+}
+
+void * realloc(void * ptr, size_t size) {
+  return my_realloc(ptr, size);
+}
+
+int posix_memalign(void ** memptr, size_t alignment, size_t size) {
+  return my_posix_memalign(memptr, alignment, size);
+}
+
+void * aligned_alloc(size_t alignment, size_t size) {
+  return my_aligned_alloc(alignment, size);
+}
+
+void * memalign(size_t alignment, size_t size) {
+  return my_memalign(alignment, size);
+}
+
+size_t malloc_usable_size(void * p) {
+  return my_malloc_usable_size(p);
+}
@@ -46,6 +46,8 @@ static inline const char * allocated_to_string(char allocated) {
       return "true";
     case FENCEPOST:
       return "fencepost";
+    case MMAPPED:
+      return "mmapped";
   }
   assert(false);
 }
@@ -80,6 +82,9 @@ static void print_color(header * block) {
     case FENCEPOST:
       printf("\033[0;33m");
       break;
+    case MMAPPED:
+      printf("\033[0;35m");
+      break;
   }
 }
 
@@ -90,14 +95,34 @@ static void clear_color() {
 }
 
 static inline bool is_sentinel(void * p) {
-  for (int i = 0; i < N_LISTS; i++) {
-    if (&freelistSentinels[i] == p) {
-      return true;
+  for (int a = 0; a < N_ARENAS; a++) {
+    for (int i = 0; i < N_LISTS; i++) {
+      if (&arenas[a].freelistSentinels[i] == p) {
+        return true;
+      }
     }
   }
   return false;
 }
 
+/**
+ * @brief Print a label before the contents of every arena but the main one
+ * so single threaded programs print exactly what they did with one arena
+ *
+ * @param a The index of the arena about to be printed
+ *
+ * @return true if the arena is in use and should be printed
+ */
+static bool print_arena_label(int a) {
+  if (!arenas[a].initialized) {
+    return false;
+  }
+  if (a > 0) {
+    printf("ARENA %d\n", a);
+  }
+  return true;
+}
+
 /**
  * @brief Print the free list pointers if RELATIVE_POINTERS is set to true
  * then print the pointers as an offset from the base of the heap. This allows
@@ -135,11 +160,11 @@ void print_object(header * block) {
   printf("\tallocated: %s\n", allocated_to_string(get_object_state(block)));
   if (!get_object_state(block)) {
     printf("\tprev: ");
-    print_pointer(block->prev);
+    print_pointer(get_prev(block));
     puts("");
 
     printf("\tnext: ");
-    print_pointer(block->next);
+    print_pointer(get_next(block));
     puts("");
   }
   printf("]\n");
@@ -164,26 +189,35 @@ void print_status(header * block) {
     case FENCEPOST:
       printf("[F]");
       break;
+    case MMAPPED:
+      printf("[M]");
+      break;
   }
   clear_color();
 }
 
-/*
-static void print_bitmap() {
-  printf("bitmap: [");
-  for(int i = 0; i < N_LISTS; i++) {
-    if ((freelist_bitmap[i >> 3] >> (i & 7)) & 1) {
-      printf("\033[32m#\033[0m");
-    } else {
-      printf("\033[34m_\033[0m");
+/**
+ * @brief Print which freelists are non-empty according to the freelist bitmap
+ */
+void print_bitmap() {
+  for (int a = 0; a < N_ARENAS; a++) {
+    if (!print_arena_label(a)) {
+      continue;
     }
-    if (i % 8 == 7) {
-      printf(" ");
+    printf("bitmap: [");
+    for(int i = 0; i < N_LISTS; i++) {
+      if ((arenas[a].freelist_bitmap[i >> 3] >> (i & 7)) & 1) {
+        printf("\033[32m#\033[0m");
+      } else {
+        printf("\033[34m_\033[0m");
+      }
+      if (i % 8 == 7) {
+        printf(" ");
+      }
     }
+    puts("]");
   }
-  puts("]");
 }
-*/
 
 /**
  * @brief Print a linked list between two nodes using a provided print function
@@ -193,7 +227,7 @@ static void print_bitmap() {
  * @param end Node to stop printing at
  */
 void print_sublist(printFormatter pf, header * start, header * end) {  
-  for (header * cur = start; cur != end; cur = cur->next) {
+  for (header * cur = start; cur != end; cur = get_next(cur)) {
     pf(cur); 
   }
 }
@@ -208,14 +242,19 @@ void freelist_print(printFormatter pf) {
     return;
   }
 
-  for (size_t i = 0; i < N_LISTS; i++) {
-    header * freelist = &freelistSentinels[i];
-    if (freelist->next != freelist) {
-      printf("L%zu: ", i);
-      print_sublist(pf, freelist->next, freelist);
-      puts("");
+  for (int a = 0; a < N_ARENAS; a++) {
+    if (!print_arena_label(a)) {
+      continue;
+    }
+    for (size_t i = 0; i < N_LISTS; i++) {
+      header * freelist = &arenas[a].freelistSentinels[i];
+      if (get_next(freelist) != freelist) {
+        printf("L%zu: ", i);
+        print_sublist(pf, get_next(freelist), freelist);
+        puts("");
+      }
+      fflush(stdout);
     }
-    fflush(stdout);
   }
 }
 
@@ -229,15 +268,20 @@ void tags_print(printFormatter pf) {
     return;
   }
 
-  for (size_t i = 0; i < numOsChunks; i++) {
-    header * chunk = osChunkList[i];
-    pf(chunk);
-    for (chunk = get_right_header(chunk);
-         get_object_state(chunk) != FENCEPOST; 
-         chunk = get_right_header(chunk)) {
-        pf(chunk);
+  for (int a = 0; a < N_ARENAS; a++) {
+    if (!print_arena_label(a)) {
+      continue;
+    }
+    for (size_t i = 0; i < arenas[a].numOsChunks; i++) {
+      header * chunk = arenas[a].osChunkList[i];
+      pf(chunk);
+      for (chunk = get_right_header(chunk);
+           get_object_state(chunk) != FENCEPOST; 
+           chunk = get_right_header(chunk)) {
+          pf(chunk);
+      }
+      pf(chunk);
+      fflush(stdout);
     }
-    pf(chunk);
-    fflush(stdout);
   }
 }
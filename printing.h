@@ -22,6 +22,7 @@ void print_status(header * block);
  */
 void freelist_print(printFormatter pf);
 void tags_print(printFormatter pf);
+void print_bitmap();
 
 /* Helpers */
 void print_sublist(printFormatter pf, header * start, header * end);